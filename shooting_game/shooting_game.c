@@ -3,8 +3,38 @@
 #include <time.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+/* Build: gcc shooting_game.c -o shooting_game -lncurses -pthread -lz */
 
 #define TICK_US 40000
+#define TICK_HZ (1000000/TICK_US)
+
+/* A tick that overruns the schedule by more than this many periods
+   restarts it from now instead of bursting to catch up */
+#define PACE_SLACK 4
+#define INPUTQ_SIZE 256
 
 #define PLAYER_LIVES 3
 #define PLAYER_COLOR 1
@@ -14,18 +44,208 @@
 #define TEXT_COLOR 5
 #define MENU_COLOR 6
 
-typedef struct Bullet {
-    int x, y;
-    int dy;
-    struct Bullet *next;
-} Bullet;
+/* Stress mode keeps the field topped up to these populations */
+#define STRESS_ENEMIES 50000
+#define STRESS_BULLETS 100000
+#define STRESS_BURST 8000
+#define STRESS_FAN 5
+#define STRESS_BARRAGE 300
 
-typedef struct Enemy {
-    int x, y;
-    int tick_counter;
-    int speed_ticks;
-    struct Enemy *next;
-} Enemy;
+/* Sprite art is at most this big; one row of it fits a collision mask
+   with a column to spare on either side */
+#define SPRITE_MAX_W 16
+#define SPRITE_MAX_H 4
+
+/* In normal play, one spawn in BRUTE_ODDS is a brute */
+#define BRUTE_ODDS 8
+
+/* Script timers: wheel slots (a power of two), one tick each; later
+   wakeups go round the wheel */
+#define WHEEL_SLOTS 256
+
+/* Wave choreography: stragglers dropped one at a time between formations,
+   weavers in a V, divers in a line across the field */
+#define WAVE_STRAGGLERS 6
+#define VEE_SIZE 5
+#define LINE_SIZE 8
+#define LINE_GAP_TICKS 4
+
+/* Weavers sidestep every WEAVE_TICKS, turning after WEAVE_STEPS; divers
+   drift at half speed, hover, then drop at DIVE_BOOST times the speed */
+#define WEAVE_TICKS 5
+#define WEAVE_STEPS 6
+#define DIVE_DRIFT_TICKS (TICK_HZ*3/2)
+#define DIVE_HOVER_TICKS (TICK_HZ/2)
+#define DIVE_BOOST 3
+
+/* Stackless coroutines, protothreads style: a script's body is one
+   switch on its saved resume point. CO_WAIT saves the line and returns
+   how many ticks to sleep; the next call jumps back in right after it.
+   Locals do not survive a wait, so scripts keep their state in the
+   entity's own fields. */
+#define CO_BEGIN(pc) switch(pc){ case 0:
+#define CO_WAIT(pc,ticks) do{ (pc)=__LINE__; return (ticks); case __LINE__:; }while(0)
+#define CO_END(pc) } (pc)=0; return -1
+
+/* Explosion particles: ring capacity (a power of two), the most spawned
+   in one tick, and the fixed lifetime of each kind in ticks */
+#define PARTICLE_CAP 4096
+#define PARTICLE_BUDGET 240
+#define DEBRIS_PER_HIT 4
+#define FLASH_LIFE 3
+#define DEBRIS_LIFE 10
+
+/* Headless runs (benchmarks, -H) simulate a field of this size */
+#define HEADLESS_W 200
+#define HEADLESS_H 60
+
+/* Fixed work partition of one tick, independent of the thread count:
+   enemy updates by column stripe, collision resolution by row band */
+#define NSTRIPES 64
+
+/* Entity positions and velocities are 16.16 fixed point; they snap to
+   cells only for collision cells and rendering */
+#define FX_SHIFT 16
+#define FX_ONE (1<<FX_SHIFT)
+#define FX(c) ((c)*FX_ONE)
+#define CELL(v) ((v)>>FX_SHIFT)
+/* Per-tick step for a speed in cells per second */
+#define FX_PER_TICK(cps) ((int)((cps)*FX_ONE/TICK_HZ))
+
+/* Shots travel this many rows per second */
+#define SHOT_SPEED 25.0
+
+/* Output budget (-B): priority buckets for changed cells, the burst the
+   byte bucket may save up (in ms of budget), the priority a held-back
+   cell gains per frame, and the first guess at bytes per changed cell */
+#define BW_LEVELS 256
+#define BW_BURST_MS 250
+#define BW_AGE_BOOST 4
+#define BW_CELL_COST 8.0
+
+/* Compressed stream (-z): deflate window and hash sizes per session,
+   bounding its state to about 2^(ZS_WBITS+2) + 2^(ZS_MEMLEVEL+9) bytes,
+   and the output chunk */
+#define ZS_WBITS 12
+#define ZS_MEMLEVEL 5
+#define ZS_CHUNK 4096
+
+/* Session recording (-a): ring between the tap and the writer (a power of
+   two), the writer's batch buffer, how long it naps when idle, and the
+   size at which the file rotates, keeping REC_KEEP old ones */
+#define REC_RING_SIZE ((size_t)1<<20)
+#define REC_BATCH (64<<10)
+#define REC_IDLE_US 20000
+#define REC_MAX_BYTES ((long)32<<20)
+#define REC_KEEP 3
+
+/* High-score file shared by both games: one table per game and level */
+#define SCORE_MAGIC 0x54545953u
+#define SCORE_GAMES 2
+#define SCORE_LEVELS 3
+#define SCORE_TOP 10
+#define SCORE_GAME_SNAKE 0
+#define SCORE_GAME_SHOOTER 1
+
+/* Replays (-w): file magic and layout version, and how many ticks apart
+   the state hash chain is written out */
+#define REPLAY_MAGIC 0x52595454u
+#define REPLAY_VERSION 2
+#define REPLAY_HASH_EVERY 8
+#define REPLAY_HASH (-1)
+
+/* Rewind (hold R): byte ring for keyframes and the key records between
+   them, keyframes kept (a power of two) and the ticks between them, ticks
+   stepped back per tick while rewinding, and how long one press of the
+   key keeps it going */
+#define REWIND_BYTES ((size_t)4<<20)
+#define REWIND_KEYFRAMES 32
+#define REWIND_KEYFRAME_TICKS TICK_HZ
+#define REWIND_SPEED 10
+#define REWIND_HOLD_MS 200
+
+/* Snapshots (-k): file magic and layout version, and the default seconds
+   between them */
+#define SNAP_MAGIC 0x53535454u
+#define SNAP_VERSION 1
+#define SNAP_SECS 10
+/* Largest pool, registry or timer capacity a snapshot may ask for: every
+   entity holds a handle slot, so none can outgrow the slot space */
+#define SNAP_CAP_MAX (1<<HANDLE_SLOT_BITS)
+/* Recorded capacity: a pool not grown yet gets the 64 its first growth
+   would give it, so a valid file never holds a zero */
+#define SNAP_CAP(c) ((c)?(c):64)
+
+/* Zygote (-Z): pending connections it queues, and the fds a session
+   hands over (its stdin, stdout and stderr) */
+#define ZYGOTE_BACKLOG 64
+#define ZYGOTE_FDS 3
+
+/* Debug log (-l): threads that can log, records per thread ring (a power
+   of two), and how often the drain thread empties them */
+#define LOG_MAX_THREADS 64
+#define LOG_RING_RECS 4096
+#define LOG_DRAIN_US 50000
+
+/* Distinct allocation sites the heap instrumentation can tell apart */
+#define HEAP_SITES 64
+
+/* Address space reserved for the bump arenas; pages are committed on use */
+#define TICK_ARENA_RESERVE ((size_t)512<<20)
+#define FRAME_ARENA_RESERVE ((size_t)64<<20)
+
+/* Spent bullets are parked far outside the field; the next advance culls them */
+#define DEAD_Y FX(-1000)
+
+/* Generational entity handles: registry slot in the low 22 bits, the
+   slot's generation above. A handle resolves until its entity is removed;
+   then the slot's generation moves on, so holding on to a handle across
+   ticks is safe (a stale one could only alias after its slot is reused
+   a multiple of 1024 times). 0 is never a valid handle. */
+typedef uint32_t Handle;
+#define HANDLE_NONE 0
+#define HANDLE_SLOT_BITS 22
+#define HANDLE_GEN_MASK ((1u<<(32-HANDLE_SLOT_BITS))-1)
+#define HANDLE_SLOT(h) ((int)((h)&((1u<<HANDLE_SLOT_BITS)-1)))
+#define HANDLE_GEN(h) ((h)>>HANDLE_SLOT_BITS)
+
+/* Index and generation share a slot so a lookup touches one cache line */
+typedef struct {
+    int dense;              /* pool index, -1 while free */
+    unsigned gen;
+} RegSlot;
+
+/* Maps handle slots to indices in one dense pool. Freed slots queue up in
+   a FIFO ring so reuse is spread over all of them. */
+typedef struct {
+    int n_slots, cap;       /* cap is a power of two */
+    RegSlot *slots;
+    int *free_q;
+    unsigned free_head, free_tail;
+} Registry;
+
+/* Entities live in dense struct-of-arrays pools and are addressed from
+   outside by handle. Removal is deferred: a destroyed entity is only
+   marked (y below the field) and the pool is compacted, in order, at the
+   end of the tick, so iteration never walks holes. */
+typedef struct {
+    int n, cap;
+    int *x, *y;
+    int *py;                /* y at the start of the tick */
+    int *vy;                /* fall per tick */
+    unsigned char *kind;    /* sprite */
+    unsigned char *script;  /* SCRIPT_*, its resume point and counter */
+    unsigned short *pc;
+    unsigned char *ctr;
+    Handle *id;
+} Enemies;
+
+typedef struct {
+    int n, cap;
+    int *x, *y;
+    int *dx, *dy;
+    Handle *id;
+} Bullets;
 
 typedef struct {
     int x, y;
@@ -33,108 +253,971 @@ typedef struct {
     int score;
 } Player;
 
+enum { SPR_PLAYER, SPR_GRUNT, SPR_BRUTE, NUM_SPRITES };
+
+enum { SCRIPT_NONE, SCRIPT_WEAVE, SCRIPT_DIVE, NUM_SCRIPTS };
+
+/* Pending script wakeups, hashed by tick into a wheel of singly linked
+   lists over one node pool. A node holds the enemy's handle (HANDLE_NONE
+   for the wave director), so one that died in the meantime is simply
+   dropped when its timer fires. */
+typedef struct {
+    Handle h;
+    unsigned long when;
+    int next;
+} Timer;
+
+typedef struct {
+    int head[WHEEL_SLOTS];
+    Timer *t;
+    int n, cap;
+    int free;               /* free node list, -1 if empty */
+} TimerWheel;
+
+/* The wave director's coroutine state */
+typedef struct {
+    unsigned short pc;
+    unsigned char n;
+    int x;
+} Wave;
+
+/* Multi-cell sprite. The art is given as rows of glyphs, blanks being
+   transparent; the entity's position is the anchor cell (ax, ay) of it.
+   init_sprites() compiles the art into per-row bitmasks: mask has bit c
+   set where column c is drawn, hit is the same widened by one column
+   either side (the shot hitbox) and shifted up by one, so bit c+1 stands
+   for column c. cols transposes hit: bit r of cols[c+1] is set when
+   row r is hit at column c. */
+typedef struct {
+    const char *art[SPRITE_MAX_H];
+    int ax, ay;
+    int points;             /* score for shooting it down */
+    int w, h;
+    uint32_t mask[SPRITE_MAX_H];
+    uint32_t hit[SPRITE_MAX_H];
+    uint32_t cols[SPRITE_MAX_W+2];
+} Sprite;
+
+/* Bump arena over one reserved mapping. It never moves or grows, so
+   transient data costs no heap calls; reset drops everything at once. */
+typedef struct {
+    char *base;
+    size_t used, cap, peak;
+} Arena;
+
+typedef struct {
+    short x, y;
+    chtype ch;
+} DrawCell;
+
+/* One color run: all cells drawn with the same pair */
+typedef struct {
+    int n;
+    DrawCell *cells;
+} DrawRun;
+
+enum { RUN_ENEMY, RUN_SHOT, RUN_ENEMY_SHOT, RUN_PARTICLE, NUM_RUNS };
+
+enum { PARTICLE_FLASH, PARTICLE_DEBRIS };
+
+/* Hit explosions live in a fixed ring: live particles are [tail, head),
+   a full ring overwrites its oldest. All share one of two lifetimes, so
+   expiry is close to birth order and the tail only skips a short run of
+   finished ones. Purely visual: they use their own RNG and stay out of
+   the checksum. */
+typedef struct {
+    unsigned head, tail;
+    int spawned;                /* this tick, against PARTICLE_BUDGET */
+    int x[PARTICLE_CAP], y[PARTICLE_CAP];
+    int dx[PARTICLE_CAP], dy[PARTICLE_CAP];
+    unsigned char age[PARTICLE_CAP], kind[PARTICLE_CAP];
+} Particles;
+
+/* Immutable copy of everything the renderer needs for one frame.
+   Entities are bucketed by color pair so each run sets its attribute once. */
+typedef struct {
+    unsigned long tick;
+    unsigned long skipped;
+    Player player;
+    int paused;
+    int rewinding;
+    int n_enemies, n_bullets;
+    long long sim_ns;
+    unsigned long tps;          /* ticks in the last whole second (turbo) */
+    unsigned long heap_tick;    /* heap calls in this tick (-m) */
+    size_t heap_live;
+    long rss_kb;
+    DrawRun runs[NUM_RUNS];
+    Arena arena;            /* backs runs[], reset by each snapshot */
+} Frame;
+
+/* Bulk bullet kernels. advance moves every bullet and compacts away the
+   ones that left the field; hits writes the (ascending) indices of bullets
+   that may have hit an enemy or the player and returns how many. */
+typedef struct {
+    const char *name;
+    void (*advance)();
+    int (*hits)(int *out);
+} Kernels;
+
+/* Per-stripe (and per-band) scratch: its own PRNG stream for the tick and
+   the side effects it produced, merged in stripe order afterwards. Shot
+   buffers come from the tick arena, sized for every enemy firing. */
+typedef struct {
+    uint64_t rng;
+    int n_shots;
+    int *shot_x, *shot_y;
+    int lives_lost;
+    int removed;
+    uint64_t zdelta;            /* state hash keys of enemies it removed */
+} Stripe;
+
+typedef struct {
+    int key;
+    unsigned long tick;     /* simulation tick the key arrived in */
+    long long t_ns;         /* CLOCK_MONOTONIC arrival time */
+} KeyEvent;
+
 /* GLOBALS */
 int max_x, max_y;
 Player player;
-Enemy *enemies = NULL;
-Bullet *bullets = NULL;
+Enemies enemies;
+Bullets bullets;
+Registry enemy_reg, bullet_reg;
+Particles particles;
+uint64_t fx_rng;
+
+Sprite sprites[NUM_SPRITES]={
+    [SPR_PLAYER]={ { "<^>" }, 1, 0, 0 },
+    [SPR_GRUNT]={ { "W" }, 0, 0, 10 },
+    [SPR_BRUTE]={ { "/W\\", "\\_/" }, 1, 0, 50 },
+};
+
+/* Anchor offsets, over all enemy sprites, at which an enemy can touch a
+   given cell: columns [reach_x0, reach_x1] from it and rows down to
+   reach_y1 past enemy_rows_max */
+int reach_x0, reach_x1, reach_y0, reach_y1;
+
+TimerWheel wheel;
+Wave wave;
+
+/* Transient simulation data (broadphase chains, candidate lists, stripe
+   orders and shot batches) lives in this arena and is dropped by end_tick() */
+Arena tick_arena;
+
+/* Heap calls made through xmalloc() and friends; a steady-state tick must
+   not add to it */
+unsigned long heap_calls = 0;
+
+/* Opt-in heap instrumentation (-m): calls and bytes per allocation site
+   (the calling function), live and peak bytes by malloc_usable_size(),
+   calls per tick and peak RSS. Every site runs on the simulation thread. */
+typedef struct {
+    const char *site;
+    unsigned long calls;
+    size_t bytes;
+} HeapSite;
+
+int mem_stats = 0;
+HeapSite heap_sites[HEAP_SITES];
+int n_heap_sites = 0;
+size_t heap_live = 0, heap_peak = 0;
+unsigned long heap_tick_mark = 0, heap_tick_calls = 0, heap_tick_max = 0;
+
+/* Collision broadphase: per-cell chains of enemy indices, rebuilt each tick */
+int *grid_head = NULL;
+int *enemy_next = NULL;
+
+/* Cells swept by an enemy this tick, widened by the hitbox; padded so
+   vector kernels can load a whole int at the last cell */
+unsigned char *sweep_occ = NULL;
+
+/* Bullet indices flagged by the hit-test kernel, with the enemy each one
+   reached (found per row band), resolved in scalar code */
+int *hit_cand = NULL;
+int *cand_hit = NULL;
+int *cand_y = NULL;
+
+/* Render aggregation: entity count, kinds and the last glyph per cell */
+unsigned short *cell_count = NULL;
+unsigned char *cell_kind = NULL;
+unsigned char *cell_glyph = NULL;
 
 int game_over = 0;
 int paused = 0;
+int stress = 0;
+int run_seconds = 0;
+Kernels *kern;
+
+/* All simulation randomness comes from sim_seed: serial spawning draws
+   from sim_rng, stripe work from streams derived from (seed, tick, stripe) */
+uint64_t sim_seed;
+uint64_t sim_rng;
+Stripe stripes[NSTRIPES];
+int stripe_start[NSTRIPES+1];
+int *stripe_order = NULL;
+int enemies_dead = 0;
+
+/* Incremental state hash, Zobrist style: the XOR of one key per live
+   enemy and bullet, updated on spawn, despawn and script moves; the
+   player is mixed in when it is read. Positions are 16.16 fixed point,
+   too many for key tables, so a key is a hash of the entity's handle,
+   kind and straight-line path: its position wound back by its velocity
+   times the passes that moved it. Plain per-tick motion then leaves
+   every key, and the hash, unchanged. -X rehashes from scratch after
+   every tick and counts disagreements. */
+uint64_t zhash = 0;
+unsigned zh_enemy_pass = 0, zh_bullet_pass = 0;
+int hash_check = 0;
+unsigned long hash_checked = 0, hash_bad = 0, hash_first_bad = 0;
+
+/* Worker pool for the partitioned tick; jobs are claimed from pool_next */
+int sim_threads = 1;
+pthread_t *pool_tids;
+pthread_mutex_t pool_mu = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_cv = PTHREAD_COND_INITIALIZER;
+pthread_cond_t pool_done_cv = PTHREAD_COND_INITIALIZER;
+void (*pool_fn)(int job);
+int pool_jobs, pool_gen = 0, pool_busy = 0, pool_quit = 0;
+atomic_int pool_next;
+
+/* Difficulty, in per-second units */
+double spawn_interval;      /* seconds between spawns */
+double enemy_speed;         /* rows per second */
+double enemy_fire_rate;     /* shots per enemy per second */
+
+/* The same, converted to ticks by set_tick_rates() */
+int spawn_ticks;
+int enemy_vy;
+int enemy_rows_max;         /* most rows an enemy can cross in a tick */
+uint32_t enemy_fire_p;      /* per-tick chance, scaled to 2^32 */
+int shot_vy;
+
+/* Load test timings, accumulated per tick */
+long long sim_ns = 0, sim_ns_total = 0, snap_ns_total = 0, render_ns_total = 0;
+long long pop_enemies_total = 0, pop_bullets_total = 0;
+unsigned long ticks_run = 0;
+
+/* Pacing. Game time per tick is always TICK_US; -r only changes how fast
+   ticks run on the wall clock, on an absolute schedule tick_ns apart (0:
+   uncapped). Frames are taken at most every frame_ns; ticks in between
+   are decimated, never snapshotted. */
+int turbo = 0;
+long long tick_ns = TICK_US*1000LL, frame_ns = TICK_US*1000LL;
+long long next_tick_at = 0, next_frame_at = 0;
+unsigned long frames_decimated = 0;
+/* Ticks per whole wall-clock second: the last one and the slowest */
+long long tps_window = 0;
+unsigned long tps_count = 0, tps_last = 0, tps_min = 0;
+
+/* Threaded mode: the simulation publishes frames through a lock-free
+   triple buffer, the render thread presents the newest one. frames[tb_back]
+   is sim-owned, frames[tb_front] render-owned, tb_mid holds the latest
+   published frame with TB_FRESH set until the renderer picks it up. */
+#define TB_FRESH 4
+int threaded = 0;
+Frame frames[3];
+int tb_back = 0, tb_front = 1;
+atomic_int tb_mid = 2;
+atomic_int render_running = 0;
+pthread_t render_tid;
+
+atomic_ulong sim_tick = 0;
+unsigned long frames_published = 0, frames_skipped = 0;
+unsigned long frames_rendered = 0, frames_duplicated = 0;
+
+/* The input thread blocks on the tty, decodes keys and pushes them into
+   an SPSC ring that the simulation drains at the start of each tick. */
+KeyEvent inputq[INPUTQ_SIZE];
+atomic_uint inputq_head = 0, inputq_tail = 0;
+atomic_int input_running = 0;
+pthread_t input_tid;
+unsigned long keys_applied = 0, keys_dropped = 0;
+long long input_lat_sum = 0, input_lat_max = 0;
+unsigned long input_lag_sum = 0, input_lag_max = 0;     /* in ticks */
+
+/* Session statistics printed at exit (-v) */
+int show_stats = 0;
+
+/* Terminal output accounting, fed by the write() tap below while curses
+   owns the terminal (out_tap) */
+int out_tap = 0;
+unsigned long out_bytes = 0, out_sgr_bytes = 0;
+int out_esc_state = 0, out_esc_len = 0;
+unsigned long out_frame_bytes = 0, out_frame_sgr = 0;
+unsigned long out_mark_bytes = 0, out_mark_sgr = 0;
+
+/* Output budget (-B bytes/s) for slow links: a byte bucket refilled at
+   the budget and drained by what the write tap actually saw. Each frame
+   only as many changed cells as the bucket affords go out, most important
+   first (score and lives, then play cells by distance from the player,
+   then the rest of the HUD and the borders); the others are held back
+   and age until they win. Render-side only. */
+long bw_budget = 0;
+double bw_tokens = 0, bw_cell_cost = BW_CELL_COST;
+long long bw_refill_at = 0;
+unsigned short *bw_age = NULL;      /* frames each cell has been held back */
+int *bw_cells = NULL, *bw_order = NULL;
+unsigned char *bw_level = NULL;
+int bw_sent = 0, bw_held = 0, bw_age_max = 0;
+unsigned long bw_frames = 0, bw_held_total = 0, bw_stale_max = 0, bw_bytes_total = 0;
+
+/* Compressed copy of the terminal stream (-z path), as a server session
+   would send it: one streaming deflate per session with a bounded window,
+   sync-flushed at the end of each frame (MCCP2 style), so a client can
+   decode every frame as soon as it arrives. Fed by the write() tap on
+   whichever thread renders. */
+typedef struct {
+    z_stream zs;
+    int fd;
+    unsigned long raw, packed, frames;
+    long long cpu_ns;
+    unsigned char out[ZS_CHUNK];
+} ZSession;
+
+ZSession *zsess = NULL;
+
+/* asciicast v2 recorder (-a path). The tap only copies each write into an
+   SPSC byte ring as a (time, length) header and the bytes, or drops it if
+   the ring is full; it never blocks. A writer thread turns records into
+   event lines and appends them in batches, rotating the file at
+   REC_MAX_BYTES. Every file starts with its own header. */
+typedef struct {
+    long long t_ns;
+    uint32_t len, pad;
+} RecHeader;
+
+typedef struct {
+    const char *path;
+    int fd;
+    long file_bytes;
+    int files;
+    long long t0;
+    unsigned char *ring;
+    atomic_size_t head, tail;
+    size_t fill_max;
+    unsigned long events, dropped;
+    unsigned long long written;
+    char *batch;
+    size_t batch_n;
+    atomic_int running;
+    pthread_t tid;
+} Recorder;
+
+Recorder *rec = NULL;
 
-/* Difficulty variables */
-int spawn_rate;
-int enemy_speed;
-int enemy_fire_chance;
+/* Persistent high scores, mapped MAP_SHARED from a fixed-layout file that
+   the snake uses too (keep the two copies of the layout identical). An
+   all-zero file is a valid empty one. Readers never lock: a table's seq
+   is odd while it changes, and a reader copies until it sees the same
+   even seq on both sides. A score that cannot place is turned away on
+   that read alone; one that can takes a short fcntl() lock on just its
+   table's bytes, so other tables and other readers never wait. */
+typedef struct {
+    int32_t score;
+    uint32_t when;
+    char name[24];
+} ScoreEntry;
+
+typedef struct {
+    _Alignas(64) atomic_uint seq;
+    int32_t n;
+    ScoreEntry top[SCORE_TOP];
+} ScoreTable;
+
+typedef struct {
+    atomic_uint magic;
+    ScoreTable tables[SCORE_GAMES][SCORE_LEVELS];
+} ScoreFile;
+
+const char *score_path = NULL;
+
+/* Replay file, shared in layout with the snake: a header, then records
+   in tick order. A key record holds a key applied before the step that
+   starts at its tick; a hash record holds the state hash chain after the
+   step that ended at its tick. The header's tick count and score are
+   filled in when the game ends. */
+typedef struct {
+    uint32_t magic, version;
+    uint64_t seed;
+    int32_t game, level;
+    int32_t x0, y0, w, h;       /* field the game was played on */
+    int32_t ticks, score;
+} ReplayHeader;
+
+typedef struct {
+    uint32_t tick;
+    int32_t key;                /* or REPLAY_HASH */
+    uint64_t hash;
+} ReplayRec;
+
+/* Verdict on one replay, written by a verifier worker into shared memory */
+typedef struct {
+    int status;                 /* 0 accepted, 1 rejected, 2 unreadable */
+    int tick, score;
+    long ticks;
+    char why[64];
+} VerifyResult;
+
+FILE *replay_out = NULL;
+const char *replay_path = NULL;
+ReplayHeader replay_hdr;
+uint64_t replay_chain;
+long replay_recs = 0;
+
+/* Rewind buffer. Spawns, despawns and moves all follow from the seed and
+   the player's keys, so the per-tick delta kept is just the keys applied
+   in it (ticks without any cost nothing). A keyframe of the whole
+   simulation state goes in every REWIND_KEYFRAME_TICKS; stepping back
+   restores the last keyframe at or before the target and re-simulates up
+   to it, then drops everything after. Both live in one byte ring, at
+   running offsets [rw_tail, rw_head); making room drops the oldest
+   keyframe and the keys after it. Normal play only, and not while a
+   replay is written; a rewound game is practice and is not scored. */
+typedef struct {
+    uint32_t tick;
+    int32_t key;
+} RewindRec;
+
+typedef struct {
+    unsigned long tick;
+    size_t off;
+} Keyframe;
+
+enum { RW_MEASURE, RW_SAVE, RW_LOAD, RW_WRITE, RW_READ };
+
+int rewind_on = 0;
+unsigned char *rw_ring = NULL;
+size_t rw_head = 0, rw_tail = 0;
+Keyframe rw_kf[REWIND_KEYFRAMES];
+unsigned kf_head = 0, kf_tail = 0;
+long long rewind_until = 0, rewind_ns = 0;
+unsigned long ticks_rewound = 0, rewind_steps = 0, rewind_resim = 0;
+
+/* Background snapshots (-k path). Every snap_secs the game fork()s at a
+   tick boundary; the child has a copy-on-write image of the state as of
+   that instant and writes it out with walk_state() while the parent goes
+   on ticking. It writes path.tmp, fsyncs it and renames it over path, so
+   a crash at any point leaves the previous snapshot whole. One child at a
+   time; the parent reaps it without blocking. Started with -k and the
+   file present, the game resumes from it. */
+typedef struct {
+    uint32_t magic, version;
+    uint64_t seed;
+    int32_t game, level, w, h;
+    int32_t caps[5];            /* enemy and bullet pools and registries, timers */
+    uint64_t size;              /* state bytes after the header */
+    uint64_t check;             /* FNV-1a of the state, then the header (check 0) */
+} SnapHeader;
+
+const char *snap_path = NULL;
+int snap_secs = SNAP_SECS, snap_level = 0;
+int snap_fd = -1, snap_err = 0;
+uint64_t snap_sum;
+pid_t snap_pid = 0;
+long long snap_next_at = 0, snap_started_at = 0;
+long long snap_fork_ns = 0, snap_fork_max = 0, snap_write_ns = 0;
+unsigned long snap_forks = 0, snap_written = 0, snap_failed = 0;
+size_t snap_bytes = 0;
+int snap_resumed = 0;
+unsigned long snap_resumed_tick = 0;
+long long snap_load_ns = 0;
+
+/* A zygote (-Z) pre-initializes everything not tied to a terminal: the
+   binary is linked and relocated, sprites and kernels are set up, and a
+   curses screen with its terminfo entry and color pairs is built on
+   /dev/null. Each connection passes in a terminal's fds and gets a forked
+   child playing on them; -C is the client that does that for the
+   terminal it runs on. */
+SCREEN *zygote_screen = NULL;
+int zygote_conn = -1;
+long long zygote_spawned_at = 0, first_frame_ns = 0;
+
+/* Structured debug log (-l path). A call stores a format id, the time and
+   up to four integer arguments in its thread's own SPSC ring, or counts a
+   drop when the ring is full; it never blocks or formats. The drain thread
+   merges the rings by time and does the printf work. Rings are static and
+   claimed on a thread's first call, so logging makes no heap calls. */
+enum { LOG_TICK, LOG_STRIPE, LOG_WAVE, LOG_HIT, NUM_LOG_FMTS };
 
-int spawn_counter = 0;
+static const char *const log_fmts[NUM_LOG_FMTS]={
+    [LOG_TICK]="tick %ld: %ld enemies, %ld shots fired, %ld lives left",
+    [LOG_STRIPE]="stripe %ld: %ld enemies, %ld shots, %ld removed",
+    [LOG_WAVE]="wave resumed at %ld, next in %ld ticks",
+    [LOG_HIT]="enemy %ld (kind %ld) hit at %ld,%ld",
+};
+
+typedef struct {
+    long long t_ns;
+    int fmt, pad;
+    long args[4];
+} LogRec;
+
+typedef struct {
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
+    unsigned long dropped;
+    LogRec recs[LOG_RING_RECS];
+} LogRing;
+
+FILE *log_file = NULL;
+LogRing log_rings[LOG_MAX_THREADS];
+atomic_int log_n_rings = 0;
+_Thread_local int log_slot = -1;
+atomic_int log_running = 0;
+pthread_t log_tid;
+unsigned long log_written = 0;
+
+/* Allocation sites record the function they are in */
+#define xmalloc(n) heap_malloc((n),__func__)
+#define xcalloc(n,size) heap_calloc((n),(size),__func__)
+#define xrealloc(p,n) heap_realloc((p),(n),__func__)
+#define xfree(p) heap_free((p),__func__)
 
 /* ----------- PROTOTYPES ----------- */
 void init_game();
-void draw_border();
-void draw_hud();
-void draw_entities();
+void draw_hud(const Frame *f);
+void draw_run(const DrawRun *r, int pair);
+void draw_entities(const Frame *f);
+void render_frame(const Frame *f);
+void snapshot_frame(Frame *f);
+void publish_frame();
+Frame *acquire_frame();
+void *render_main(void *arg);
+void start_render_thread();
+void stop_render_thread();
+long long now_ns();
+void pace_tick();
+int frame_due(long long now);
+int decode_key(const unsigned char *buf, int len, int *key);
+void *input_main(void *arg);
+void start_input_thread();
+void stop_input_thread();
+int next_key(KeyEvent *ev);
+void count_output(const unsigned char *buf, size_t n);
+void budget_init();
+void budget_release();
+void budget_frame(const Frame *f);
+ZSession *zs_open(const char *path);
+void zs_feed(ZSession *z, const void *buf, size_t n, int flush);
+void zs_close(ZSession *z);
+long long thread_cpu_ns();
+Recorder *rec_start(const char *path);
+void rec_stop(Recorder *r);
+void rec_push(Recorder *r, const void *buf, size_t n);
+void *rec_main(void *arg);
+int rec_open(Recorder *r);
+void rec_flush(Recorder *r);
+ScoreFile *scores_open(const char *path,int *fd);
+void scores_close(ScoreFile *sf,int fd);
+void score_read(ScoreTable *t,ScoreTable *out);
+int score_submit(ScoreFile *sf,int fd,int game,int level,int score);
+void record_score(int game,int level,int score);
+void set_level(int level);
+void apply_key(int ch);
+uint64_t chain_fold(uint64_t chain,uint64_t h);
+int replay_begin(const char *path,int level);
+void replay_key(int ch);
+void replay_tick();
+void replay_end();
+void verify_replay(const char *path,VerifyResult *r);
+int verify_replays(int n,char **paths);
+void rewind_start();
+void rewind_release();
+int rw_reserve(size_t n);
+void rw_copy(size_t at,void *p,size_t n,int mode);
+size_t walk_state(size_t at,int mode);
+void rewind_mark();
+void rewind_key(int ch);
+void rewind_step(int n);
+int snapshot_write(const char *path);
+int snapshot_load(const char *path);
+void snapshot_start();
+void snapshot_poll(int block);
+uint64_t fnv(uint64_t h, const void *p, size_t n);
+int snap_caps_ok(const SnapHeader *h);
+int sprite_fits(int kind,int x,int y);
+int timers_valid();
+void init_colors();
+int send_fds(int sock, const int *fds);
+int recv_fds(int sock, int *fds);
+int zygote_main(const char *path);
+void zygote_attach();
+int zygote_client(const char *path);
+void note_first_frame();
+void enemies_reserve(int cap);
+void bullets_reserve(int cap);
+void reg_reserve(Registry *r, int cap);
+void log_put(int fmt, long a, long b, long c, long d);
+int log_start(const char *path);
+void log_stop();
+int log_drain();
+void *log_main(void *arg);
+
+/* Log calls compile to one predictable branch while logging is off */
+#define LOG(fmt,a,b,c,d) do{ if(log_file) log_put((fmt),(a),(b),(c),(d)); }while(0)
+uint64_t rng_next(uint64_t *s);
+int rng_range(uint64_t *s, int n);
+int rng_chance(uint64_t *s, uint32_t p);
+void set_tick_rates();
+void sim_step();
+uint64_t state_checksum();
+uint64_t zmix(uint64_t a,uint64_t b);
+uint64_t enemy_key(int i,unsigned pass);
+uint64_t bullet_key(int i);
+uint64_t state_hash();
+uint64_t state_hash_full();
+void check_state_hash();
+void drop_bullet(int i);
+int run_headless(int ticks);
+void arena_init(Arena *a, size_t reserve);
+void *arena_alloc(Arena *a, size_t n);
+void arena_reset(Arena *a);
+void arena_release(Arena *a);
+void *heap_malloc(size_t n, const char *site);
+void *heap_calloc(size_t n, size_t size, const char *site);
+void *heap_realloc(void *p, size_t n, const char *site);
+void heap_free(void *p, const char *site);
+void heap_note(const char *site, size_t bytes);
+long peak_rss_kb();
+void print_heap_report();
+void *pool_main(void *arg);
+void start_pool();
+void stop_pool();
+void run_jobs(void (*fn)(int), int n);
+void bucket_by(int n, const int *key, int shift, int span);
+void update_stripe(int s);
+void resolve_band(int b);
+void compact_enemies();
+void end_tick();
+Handle reg_alloc(Registry *r, int idx);
+void reg_free(Registry *r, Handle h);
+int reg_lookup(const Registry *r, Handle h);
+void reg_reindex(Registry *r, const Handle *id, int n);
+void reg_reset(Registry *r);
+void reg_release(Registry *r);
+void destroy_enemy(int i);
+void destroy_bullet(int i);
 void update_enemies();
 void update_bullets();
+void advance_bullets_scalar();
+int hit_candidates_scalar(int *out);
+void advance_bullets_sse4();
+int hit_candidates_sse4(int *out);
+void advance_bullets_avx2();
+int hit_candidates_avx2(int *out);
+Kernels *select_kernels();
+int run_benchmarks();
+void build_grid();
+void alloc_grids();
+int find_enemy_swept(int i);
 void check_collisions();
 void process_input();
 void spawn_enemy();
-void add_enemy(int x,int y,int speed);
-void add_bullet(int x,int y,int dy);
-void remove_enemy(Enemy *prev, Enemy *e);
-void remove_bullet(Bullet *prev, Bullet *b);
+void stress_spawn();
+void add_enemy(int x,int y,int speed,int kind);
+void add_scripted(int x,int y,int kind,int script,int ctr);
+void timer_reset();
+void timer_add(Handle h,int ticks);
+void run_timers();
+int run_script(int e);
+int script_weave(int e);
+int script_dive(int e);
+int script_waves();
+void enemy_sidestep(int e,int dx);
+void init_sprites();
+void draw_sprite(const Sprite *sp,int x,int y);
+int enemy_swept_hit(int e,int x,int y0,int y1);
+int player_hit(int i);
+void add_bullet(int x,int y,int dx,int dy);
+void spawn_explosion(int x,int y);
+void update_particles();
 void clear_lists();
 int show_menu();
 
 /* ----------- MAIN ----------- */
-int main() {
-    srand(time(NULL));
-    initscr();
+int main(int argc, char **argv) {
+    int opt;
+    int bench=0,headless_ticks=0,verify=0,seed_given=0;
+    const char *zpath=NULL,*rec_path=NULL,*log_path=NULL;
+    const char *zygote_path=NULL,*client_path=NULL;
+    sim_seed=time(NULL);
+    while((opt=getopt(argc,argv,"tsd:bj:S:H:mvr:R:B:z:a:l:P:w:VXk:K:Z:C:"))!=-1) {
+        if(opt=='t') threaded=1;
+        else if(opt=='s') stress=1;
+        else if(opt=='d') run_seconds=atoi(optarg);
+        else if(opt=='b') bench=1;
+        else if(opt=='j') sim_threads=atoi(optarg);
+        else if(opt=='S'){
+            sim_seed=strtoull(optarg,NULL,0);
+            seed_given=1;
+        }
+        else if(opt=='H') headless_ticks=atoi(optarg);
+        else if(opt=='m') mem_stats=1;
+        else if(opt=='v') show_stats=1;
+        else if(opt=='r'){
+            int hz=atoi(optarg);
+            tick_ns=hz>0?1000000000LL/hz:0;
+            turbo=1;
+        }
+        else if(opt=='B') bw_budget=atol(optarg);
+        else if(opt=='z') zpath=optarg;
+        else if(opt=='a') rec_path=optarg;
+        else if(opt=='l') log_path=optarg;
+        else if(opt=='P') score_path=optarg;
+        else if(opt=='w') replay_path=optarg;
+        else if(opt=='V') verify=1;
+        else if(opt=='X') hash_check=1;
+        else if(opt=='k') snap_path=optarg;
+        else if(opt=='K' && atoi(optarg)>0) snap_secs=atoi(optarg);
+        else if(opt=='Z') zygote_path=optarg;
+        else if(opt=='C') client_path=optarg;
+        else if(opt=='R' && atoi(optarg)>0){
+            frame_ns=1000000000LL/atoi(optarg);
+            turbo=1;
+        }
+        else {
+            fprintf(stderr,"usage: %s [-t] [-s] [-d secs] [-b] [-j threads] [-S seed] [-H ticks] [-m] [-v]\n"
+                    "       [-r hz] [-R fps] [-B bytes] [-z file] [-a file] [-l file]\n"
+                    "       [-P file] [-w file] [-X] [-k file] [-K secs] [-Z sock] [-C sock]\n"
+                    "       [-V replay...]\n"
+                    "  -t          render on a separate thread\n"
+                    "  -s          start straight into Stress mode (load test)\n"
+                    "  -d secs     quit after secs seconds\n"
+                    "  -b          benchmark the bullet kernels and exit\n"
+                    "  -j threads  simulation worker threads (results do not depend on it)\n"
+                    "  -S seed     simulation seed\n"
+                    "  -H ticks    run Stress headless for ticks and print a state checksum\n"
+                    "  -m          heap instrumentation: calls per tick, live bytes, RSS and\n"
+                    "              allocation sites, on the HUD and at exit\n"
+                    "  -v          output bytes per frame on the HUD, and input and output\n"
+                    "              statistics at exit\n"
+                    "  -r hz       simulation ticks per second (default %d, 0 uncapped)\n"
+                    "  -R fps      most frames drawn per second (default %d)\n"
+                    "  -B bytes    output budget in bytes per second for slow links\n"
+                    "  -z file     also write the terminal stream deflate-compressed to file\n"
+                    "  -a file     record the session as asciicast v2\n"
+                    "  -l file     debug log, written by a background thread\n"
+                    "  -P file     high-score file (default ~/.tty-games-scores)\n"
+                    "  -w file     write a replay of the game\n"
+                    "  -X          check the incremental state hash against a full rehash\n"
+                    "              every tick\n"
+                    "  -k file     snapshot the game to file in the background, and resume\n"
+                    "              from it if it is there\n"
+                    "  -K secs     seconds between snapshots (default %d)\n"
+                    "  -Z sock     zygote: pre-initialize, then fork a game with the other\n"
+                    "              options for each terminal handed over on sock\n"
+                    "  -C sock     play on this terminal through the zygote on sock\n"
+                    "  -V          verify the replays named after the options, one process\n"
+                    "              per core, and exit\n",
+                    argv[0],TICK_HZ,TICK_HZ,SNAP_SECS);
+            return 1;
+        }
+    }
+    if(snap_path && replay_path){
+        fprintf(stderr,"%s: -k and -w cannot be combined: a resumed game has no replay\n",argv[0]);
+        return 1;
+    }
+    if(client_path) return zygote_client(client_path);
+    if(sim_threads<1) sim_threads=1;
+    init_sprites();
+    kern=select_kernels();
+    /* Threads do not survive fork(), so the pool and the log start after */
+    if(zygote_path){
+        if(zygote_main(zygote_path)<0) return 1;
+        if(!seed_given) sim_seed=time(NULL)^(uint64_t)getpid()<<32;
+    }
+    sim_rng=sim_seed;
+    fx_rng=sim_seed^0x5bd1e995ULL;
+    if(log_path && log_start(log_path)<0) return 1;
+
+    if(verify){
+        int rc=verify_replays(argc-optind,argv+optind);
+        log_stop();
+        return rc;
+    }
+    if(bench){
+        int rc=run_benchmarks();
+        log_stop();
+        print_heap_report();
+        return rc;
+    }
+    start_pool();
+    if(headless_ticks){
+        int rc=run_headless(headless_ticks);
+        stop_pool();
+        log_stop();
+        print_heap_report();
+        return rc;
+    }
+
+    if(zpath && !(zsess=zs_open(zpath))) return 1;
+    if(zygote_screen) zygote_attach();
+    else initscr();
+    out_tap=1;
     noecho();
     curs_set(FALSE);
+    cbreak();
     keypad(stdscr, TRUE);
     nodelay(stdscr, TRUE);
+    typeahead(-1);
     getmaxyx(stdscr, max_y, max_x);
+    if(rec_path && !(rec=rec_start(rec_path))){
+        endwin();
+        return 1;
+    }
 
-    start_color();
-    init_pair(PLAYER_COLOR, COLOR_GREEN, COLOR_BLACK);
-    init_pair(ENEMY_COLOR, COLOR_RED, COLOR_BLACK);
-    init_pair(BULLET_COLOR, COLOR_YELLOW, COLOR_BLACK);
-    init_pair(ENEMY_BULLET_COLOR, COLOR_MAGENTA, COLOR_BLACK);
-    init_pair(TEXT_COLOR, COLOR_CYAN, COLOR_BLACK);
-    init_pair(MENU_COLOR, COLOR_MAGENTA, COLOR_BLACK);
-
-    /* SHOW DIFFICULTY MENU */
-    int level = show_menu();
+    if(!zygote_screen) init_colors();
 
-    switch(level) {
-        case 1: /* EASY */
-            spawn_rate = 80;
-            enemy_speed = 12;
-            enemy_fire_chance = 400;
-            break;
-        case 2: /* MEDIUM */
-            spawn_rate = 50;
-            enemy_speed = 8;
-            enemy_fire_chance = 200;
-            break;
-        case 3: /* HARD */
-            spawn_rate = 25;
-            enemy_speed = 5;
-            enemy_fire_chance = 80;
-            break;
+    /* SHOW DIFFICULTY MENU, unless a snapshot says where we were */
+    int level = snap_path ? snapshot_load(snap_path) : 0;
+    if(!level){
+        level = stress ? 4 : show_menu();
+        set_level(level);
     }
+    snap_level=level;
 
-    init_game();
+    /* All pairs share a black background, so blanks look the same in any
+       pair. Giving them the shot pair means the cells that change most on
+       a busy screen need no SGR switch when a shot moves across them. */
+    bkgdset(' '|COLOR_PAIR(BULLET_COLOR));
 
-    while(!game_over) {
+    if(!snap_resumed) init_game();
+    if(replay_path && replay_begin(replay_path,level)<0){
+        endwin();
+        return 1;
+    }
+    if(!stress && !replay_path) rewind_start();
+    if(bw_budget) budget_init();
+    start_input_thread();
+    if(threaded) start_render_thread();
 
+    long long t_start=now_ns();
+    long long t_end = run_seconds ? t_start+run_seconds*1000000000LL : 0;
+    next_tick_at=next_frame_at=tps_window=t_start;
+    snap_next_at=t_start+snap_secs*1000000000LL;
+    while(!game_over) {
+        if(rewind_on) rewind_mark();
         process_input();
 
-        if(!paused) {
-            spawn_counter++;
-            if(spawn_counter >= spawn_rate) {
-                spawn_enemy();
-                spawn_counter = 0;
+        long long t0=now_ns();
+        if(now_ns()<rewind_until) rewind_step(REWIND_SPEED);
+        else if(!paused) sim_step();
+        long long t1=now_ns(),t2=t1;
+        sim_ns=t1-t0;
+        if(replay_out && !paused) replay_tick();
+        if(snap_path){
+            snapshot_poll(0);
+            if(t1>=snap_next_at){
+                snapshot_start();
+                snap_next_at=t1+snap_secs*1000000000LL;
             }
-
-            update_enemies();
-            update_bullets();
-            check_collisions();
         }
+        if(frame_due(t1)){
+            snapshot_frame(&frames[tb_back]);
+            t2=now_ns();
+            snap_ns_total+=t2-t1;
+            if(threaded) publish_frame();
+            else {
+                render_frame(&frames[tb_back]);
+                frames_rendered++;
+                render_ns_total+=now_ns()-t2;
+            }
+        } else frames_decimated++;
 
-        clear();
-        draw_border();
-        draw_hud();
-        draw_entities();
-        refresh();
+        sim_ns_total+=sim_ns;
+        pop_enemies_total+=enemies.n;
+        pop_bullets_total+=bullets.n;
+        ticks_run++;
+        if(t_end && t2>=t_end) game_over=1;
 
-        usleep(TICK_US);
+        pace_tick();
     }
+    double wall=(now_ns()-t_start)/1e9;
 
+    if(threaded) stop_render_thread();
+    stop_input_thread();
+    stop_pool();
+    if(replay_out) replay_end();
+    if(snap_path){
+        snapshot_poll(1);
+        /* a finished game is not resumed */
+        if(player.lives<=0) unlink(snap_path);
+    }
     clear_lists();
+    rewind_release();
     endwin();
+    out_tap=0;
+    if(replay_path)
+        printf("Replay: %s, %d ticks, %ld records\n",replay_path,replay_hdr.ticks,replay_recs);
+    if(rec){
+        Recorder *r=rec;
+        rec=NULL;
+        rec_stop(r);
+    }
+    if(zsess){
+        ZSession *z=zsess;
+        zsess=NULL;
+        printf("Compressed: %lu -> %lu bytes (%.1fx), %.1f us CPU per frame\n",
+               z->raw,z->packed,z->packed?(double)z->raw/z->packed:0.0,
+               z->frames?z->cpu_ns/1e3/z->frames:0.0);
+        zs_close(z);
+    }
     printf("Final Score: %d\n", player.score);
+    if(ticks_rewound)
+        printf("Rewind: %lu ticks taken back in %lu steps, %.2f ms and %.1f ticks "
+               "re-simulated per step; practice game, score not recorded\n",
+               ticks_rewound,rewind_steps,rewind_ns/1e6/rewind_steps,
+               (double)rewind_resim/rewind_steps);
+    else if(!stress) record_score(SCORE_GAME_SHOOTER,level,player.score);
+    if(show_stats && keys_applied)
+        printf("Input: %lu keys, %lu dropped, latency avg %lld us (%.2f ticks), "
+               "max %lld us (%lu ticks)\n",
+               keys_applied, keys_dropped,
+               input_lat_sum/(long long)keys_applied/1000,(double)input_lag_sum/keys_applied,
+               input_lat_max/1000,input_lag_max);
+    if(show_stats && frames_rendered)
+        printf("Output: %lu bytes, %lu SGR bytes, %lu/%lu per frame\n",
+               out_bytes, out_sgr_bytes,
+               out_bytes/frames_rendered, out_sgr_bytes/frames_rendered);
+    if(threaded)
+        printf("Frames: %lu published, %lu skipped, %lu rendered, %lu duplicated\n",
+               frames_published, frames_skipped, frames_rendered, frames_duplicated);
+    if(bw_budget && bw_frames)
+        printf("Budget: %ld B/s, achieved %.0f B/s, %.1f cells held back per frame, "
+               "stalest cell %lu frames\n",
+               bw_budget,bw_bytes_total/wall,(double)bw_held_total/bw_frames,bw_stale_max);
+    budget_release();
+    if(stress && ticks_run)
+        printf("Stress: %lu ticks, avg %lld enemies %lld bullets, "
+               "per tick sim %.2f ms, per frame snapshot %.2f ms, render %.2f ms\n",
+               ticks_run, pop_enemies_total/(long long)ticks_run,
+               pop_bullets_total/(long long)ticks_run,
+               sim_ns_total/1e6/ticks_run,
+               ticks_run>frames_decimated ? snap_ns_total/1e6/(ticks_run-frames_decimated) : 0.0,
+               frames_rendered ? render_ns_total/1e6/frames_rendered : 0.0);
+    if(turbo && ticks_run){
+        printf("Rate: %lu ticks in %.1f s, %.0f ticks/s",ticks_run,wall,ticks_run/wall);
+        if(tps_min) printf(" (slowest second %lu)",tps_min);
+        printf(", %lu frames drawn, %lu ticks decimated\n",frames_rendered,frames_decimated);
+    }
+    if(hash_check)
+        printf("Hash check: %lu ticks, %lu mismatches (first at tick %lu)\n",
+               hash_checked,hash_bad,hash_first_bad);
+    if(snap_resumed)
+        printf("Resumed: %s at tick %lu, loaded in %.2f ms\n",
+               snap_path,snap_resumed_tick,snap_load_ns/1e6);
+    if(snap_forks)
+        printf("Snapshots: %lu written every %d s, %lu failed, fork avg %.0f us max %.0f us, "
+               "%zu KB, child reaped %.1f ms after the fork on average\n",
+               snap_written,snap_secs,snap_failed,snap_fork_ns/1e3/snap_forks,snap_fork_max/1e3,
+               snap_bytes>>10,snap_written?snap_write_ns/1e6/snap_written:0.0);
+    if(zygote_spawned_at)
+        printf("Session: forked by zygote %d, first frame %.2f ms after the request\n",
+               getppid(),first_frame_ns/1e6);
+    for(int i=0;i<3;i++) arena_release(&frames[i].arena);
+    log_stop();
+    print_heap_report();
     return 0;
 }
 
@@ -164,12 +1247,17 @@ int show_menu() {
         mvprintw(max_y/2 + 3, max_x/2 - 4, "3. Hard");
         if(choice==3) attroff(COLOR_PAIR(MENU_COLOR));
 
-        mvprintw(max_y/2 + 5, max_x/2 - 12, "Use UP/DOWN + ENTER");
+        if(choice==4) attron(COLOR_PAIR(MENU_COLOR));
+        mvprintw(max_y/2 + 4, max_x/2 - 4, "4. Stress");
+        if(choice==4) attroff(COLOR_PAIR(MENU_COLOR));
+
+        mvprintw(max_y/2 + 6, max_x/2 - 12, "Use UP/DOWN + ENTER");
         refresh();
+        note_first_frame();
 
         ch = getch();
         if(ch==KEY_UP && choice>1) choice--;
-        else if(ch==KEY_DOWN && choice<3) choice++;
+        else if(ch==KEY_DOWN && choice<4) choice++;
         else if(ch=='\n') break;
     }
 
@@ -183,176 +1271,2800 @@ void init_game() {
     player.y = max_y - 3;
     player.lives = PLAYER_LIVES;
     player.score = 0;
+    zhash=0;
+    zh_enemy_pass=zh_bullet_pass=0;
+
+    alloc_grids();
+    arena_init(&tick_arena,TICK_ARENA_RESERVE);
+    timer_reset();
+    if(!stress) timer_add(HANDLE_NONE,spawn_ticks);
 }
 
-void draw_border() {
-    attron(COLOR_PAIR(TEXT_COLOR));
-    for(int i=0;i<max_x;i++){
-        mvaddch(1,i,'-');
-        mvaddch(max_y-2,i,'-');
-    }
-    attroff(COLOR_PAIR(TEXT_COLOR));
+void alloc_grids() {
+    grid_head = xmalloc(sizeof(int)*max_x*max_y);
+    sweep_occ = xmalloc(max_x*max_y+sizeof(int));
+    cell_count = xcalloc(max_x*max_y,sizeof(unsigned short));
+    cell_kind = xcalloc(max_x*max_y,1);
+    cell_glyph = xmalloc(max_x*max_y);
 }
 
-void draw_hud() {
-    attron(COLOR_PAIR(TEXT_COLOR));
-    mvprintw(0,2,"Score:%d Lives:%d",player.score,player.lives);
+/* Border and HUD share TEXT_COLOR and are drawn as one run */
+void draw_hud(const Frame *f) {
+    attrset(COLOR_PAIR(TEXT_COLOR));
+    mvhline(1,0,'-',max_x);
+    mvhline(max_y-2,0,'-',max_x);
+    mvprintw(0,2,"Score:%d Lives:%d",f->player.score,f->player.lives);
+    if(turbo) printw(" tps:%lu",f->tps);
+    if(bw_budget) printw(" bw:%d/%d age:%d",bw_sent,bw_sent+bw_held,bw_age_max);
+    if(mem_stats)
+        printw(" heap:%lu/t %zuK rss:%ldM",f->heap_tick,f->heap_live>>10,f->rss_kb>>10);
+    if(show_stats) printw(" out:%lu sgr:%lu",out_frame_bytes,out_frame_sgr);
+    if(threaded)
+        mvprintw(0,max_x-22,"skip:%lu dup:%lu",f->skipped,frames_duplicated);
     mvprintw(max_y-1,2,"Arrows Move | Space Shoot | P Pause | Q Quit");
-    if(paused) mvprintw(max_y/2,max_x/2-5,"PAUSED");
-    attroff(COLOR_PAIR(TEXT_COLOR));
+    if(rewind_on) printw(" | R Rewind");
+    if(stress)
+        mvprintw(max_y-1,max_x-36,"E:%d B:%d sim:%.1fms",
+                 f->n_enemies,f->n_bullets,f->sim_ns/1e6);
 }
 
 void spawn_enemy() {
-    int x = rand()%(max_x-4)+2;
-    add_enemy(x,3,enemy_speed);
+    int x = rng_range(&sim_rng,max_x-4)+2;
+    int kind = rng_range(&sim_rng,BRUTE_ODDS)==0 ? SPR_BRUTE : SPR_GRUNT;
+    add_enemy(FX(x),FX(3),enemy_vy,kind);
 }
 
-void add_enemy(int x,int y,int speed) {
-    Enemy *e = malloc(sizeof(Enemy));
-    e->x=x; e->y=y;
-    e->tick_counter=0;
-    e->speed_ticks=speed;
-    e->next=enemies;
-    enemies=e;
+/* Bullet-hell load: keep the field topped up with falling enemies (from a
+   sixth of enemy_speed up to it), have random enemies fire fans and the
+   player side send up a barrage */
+void stress_spawn() {
+    int want=STRESS_ENEMIES-enemies.n;
+    if(want>STRESS_BURST) want=STRESS_BURST;
+    int slow=enemy_vy/6;
+    for(int k=0;k<want;k++){
+        int x=rng_range(&sim_rng,max_x-4)+2;
+        add_enemy(FX(x),FX(3),slow+rng_range(&sim_rng,enemy_vy-slow+1),SPR_GRUNT);
+    }
+
+    for(int k=0;k<STRESS_BARRAGE;k++)
+        add_bullet(FX(rng_range(&sim_rng,max_x-4)+2),FX(player.y-1),0,-shot_vy);
+
+    int fans=(STRESS_BULLETS-bullets.n)/STRESS_FAN;
+    if(fans>STRESS_BURST/STRESS_FAN) fans=STRESS_BURST/STRESS_FAN;
+    for(int k=0;k<fans && enemies.n;k++){
+        int e=rng_range(&sim_rng,enemies.n);
+        for(int dx=-STRESS_FAN/2;dx<=STRESS_FAN/2;dx++)
+            add_bullet(enemies.x[e],enemies.y[e]+FX_ONE,dx*shot_vy,shot_vy);
+    }
 }
 
-void add_bullet(int x,int y,int dy){
-    Bullet *b=malloc(sizeof(Bullet));
-    b->x=x; b->y=y; b->dy=dy;
-    b->next=bullets;
-    bullets=b;
+void enemies_reserve(int cap){
+    enemies.cap=cap;
+    enemies.x=xrealloc(enemies.x,sizeof(int)*cap);
+    enemies.y=xrealloc(enemies.y,sizeof(int)*cap);
+    enemies.py=xrealloc(enemies.py,sizeof(int)*cap);
+    enemies.vy=xrealloc(enemies.vy,sizeof(int)*cap);
+    enemies.kind=xrealloc(enemies.kind,cap);
+    enemies.script=xrealloc(enemies.script,cap);
+    enemies.pc=xrealloc(enemies.pc,sizeof(unsigned short)*cap);
+    enemies.ctr=xrealloc(enemies.ctr,cap);
+    enemies.id=xrealloc(enemies.id,sizeof(Handle)*cap);
 }
 
-void update_enemies(){
-    Enemy *e=enemies,*prev=NULL;
-    while(e){
-        e->tick_counter++;
-        if(e->tick_counter>=e->speed_ticks){
-            e->tick_counter=0;
-            e->y++;
+void bullets_reserve(int cap){
+    bullets.cap=cap;
+    bullets.x=xrealloc(bullets.x,sizeof(int)*cap);
+    bullets.y=xrealloc(bullets.y,sizeof(int)*cap);
+    bullets.dx=xrealloc(bullets.dx,sizeof(int)*cap);
+    bullets.dy=xrealloc(bullets.dy,sizeof(int)*cap);
+    bullets.id=xrealloc(bullets.id,sizeof(Handle)*cap);
+}
+
+/* Positions and the fall speed are fixed point */
+void add_enemy(int x,int y,int vy,int kind) {
+    if(enemies.n==enemies.cap) enemies_reserve(enemies.cap?enemies.cap*2:64);
+    int i=enemies.n++;
+    enemies.x[i]=x; enemies.y[i]=y; enemies.py[i]=y;
+    enemies.vy[i]=vy;
+    enemies.kind[i]=kind;
+    enemies.script[i]=SCRIPT_NONE;
+    enemies.pc[i]=0;
+    enemies.ctr[i]=0;
+    enemies.id[i]=reg_alloc(&enemy_reg,i);
+    zhash^=enemy_key(i,zh_enemy_pass);
+}
+
+/* An enemy driven by a script: its first step runs now, the rest when
+   its timer fires */
+void add_scripted(int x,int y,int kind,int script,int ctr){
+    add_enemy(x,y,enemy_vy,kind);
+    int i=enemies.n-1;
+    enemies.script[i]=script;
+    enemies.ctr[i]=ctr;
+    int wait=run_script(i);
+    if(wait>0) timer_add(enemies.id[i],wait);
+}
+
+void add_bullet(int x,int y,int dx,int dy){
+    if(bullets.n==bullets.cap) bullets_reserve(bullets.cap?bullets.cap*2:64);
+    int i=bullets.n++;
+    bullets.x[i]=x; bullets.y[i]=y;
+    bullets.dx[i]=dx; bullets.dy[i]=dy;
+    bullets.id[i]=reg_alloc(&bullet_reg,i);
+    zhash^=bullet_key(i);
+}
+
+/* A flash where the hit landed and debris flying off it, unless this
+   tick's budget is spent */
+void spawn_explosion(int x,int y){
+    Particles *p=&particles;
+    if(p->spawned+1+DEBRIS_PER_HIT>PARTICLE_BUDGET) return;
+    p->spawned+=1+DEBRIS_PER_HIT;
+    for(int k=0;k<=DEBRIS_PER_HIT;k++){
+        if(p->head-p->tail==PARTICLE_CAP) p->tail++;
+        int i=p->head++&(PARTICLE_CAP-1);
+        p->x[i]=x; p->y[i]=y;
+        p->age[i]=0;
+        if(k==0){
+            p->kind[i]=PARTICLE_FLASH;
+            p->dx[i]=p->dy[i]=0;
+        } else {
+            p->kind[i]=PARTICLE_DEBRIS;
+            p->dx[i]=rng_range(&fx_rng,2*FX_ONE+1)-FX_ONE;
+            p->dy[i]=rng_range(&fx_rng,FX_ONE+1)-FX_ONE/2;
         }
+    }
+}
 
-        if(rand()%enemy_fire_chance==0)
-            add_bullet(e->x,e->y+1,1);
+/* Bulk update over the live span; finished particles are dropped from the
+   tail, and the spawn budget starts over */
+void update_particles(){
+    Particles *p=&particles;
+    for(unsigned k=p->tail;k!=p->head;k++){
+        int i=k&(PARTICLE_CAP-1);
+        p->x[i]+=p->dx[i];
+        p->y[i]+=p->dy[i];
+        if(p->age[i]<255) p->age[i]++;
+    }
+    while(p->tail!=p->head){
+        int i=p->tail&(PARTICLE_CAP-1);
+        if(p->age[i]<(p->kind[i]==PARTICLE_FLASH?FLASH_LIFE:DEBRIS_LIFE)) break;
+        p->tail++;
+    }
+    p->spawned=0;
+}
 
-        if(e->y>=max_y-3){
-            player.lives--;
-            Enemy *tmp=e;
-            e=e->next;
-            remove_enemy(prev,tmp);
-            if(player.lives<=0) game_over=1;
-            continue;
+/* Deferred destruction: the entity is only marked here. It stays in its
+   pool, and its handle keeps resolving, until end_tick(). */
+void destroy_enemy(int i){
+    zhash^=enemy_key(i,zh_enemy_pass);
+    enemies.y[i]=-1;
+    enemies_dead++;
+}
+
+void destroy_bullet(int i){
+    zhash^=bullet_key(i);
+    bullets.y[i]=DEAD_Y;
+}
+
+/* One stripe's enemies: only their own fields are written, shots go to
+   the stripe's buffer, enemies reaching the bottom are marked dead */
+void update_stripe(int s){
+    Stripe *st=&stripes[s];
+    st->rng=sim_seed^((uint64_t)(sim_tick*NSTRIPES+s)*0x9e3779b97f4a7c15ULL);
+    st->n_shots=0;
+    st->lives_lost=0;
+    st->removed=0;
+    st->zdelta=0;
+    for(int k=stripe_start[s];k<stripe_start[s+1];k++){
+        int i=stripe_order[k];
+        enemies.py[i]=enemies.y[i];
+        enemies.y[i]+=enemies.vy[i];
+
+        if(!stress && rng_chance(&st->rng,enemy_fire_p)){
+            const Sprite *sp=&sprites[enemies.kind[i]];
+            st->shot_x[st->n_shots]=enemies.x[i];
+            st->shot_y[st->n_shots]=enemies.y[i]+FX(sp->h-sp->ay);
+            st->n_shots++;
         }
-        prev=e;
-        e=e->next;
+
+        if(CELL(enemies.y[i])>=max_y-3){
+            st->zdelta^=enemy_key(i,zh_enemy_pass+1);
+            enemies.y[i]=-1;
+            st->removed++;
+            if(!stress) st->lives_lost++;
+        }
+    }
+    LOG(LOG_STRIPE,s,stripe_start[s+1]-stripe_start[s],st->n_shots,st->removed);
+}
+
+/* Enemies are processed by column stripe and the results merged in
+   stripe order, so the outcome is the same for any number of threads */
+void update_enemies(){
+    bucket_by(enemies.n,enemies.x,FX_SHIFT,max_x);
+    for(int s=0;s<NSTRIPES;s++){
+        size_t n=stress?0:stripe_start[s+1]-stripe_start[s];
+        stripes[s].shot_x=arena_alloc(&tick_arena,sizeof(int)*n);
+        stripes[s].shot_y=arena_alloc(&tick_arena,sizeof(int)*n);
     }
+    run_jobs(update_stripe,NSTRIPES);
+    zh_enemy_pass++;
+    int shots=0;
+    for(int s=0;s<NSTRIPES;s++){
+        Stripe *st=&stripes[s];
+        for(int k=0;k<st->n_shots;k++)
+            add_bullet(st->shot_x[k],st->shot_y[k],0,shot_vy);
+        shots+=st->n_shots;
+        zhash^=st->zdelta;
+        enemies_dead+=st->removed;
+        player.lives-=st->lives_lost;
+    }
+    LOG(LOG_TICK,(long)sim_tick,enemies.n,shots,player.lives);
+    if(player.lives<=0) game_over=1;
 }
 
 void update_bullets(){
-    Bullet *b=bullets,*prev=NULL;
-    while(b){
-        b->y+=b->dy;
-        if(b->y<=2||b->y>=max_y-2){
-            Bullet *tmp=b;
-            b=b->next;
-            remove_bullet(prev,tmp);
-            continue;
-        }
-        prev=b;
-        b=b->next;
+    kern->advance();
+    zh_bullet_pass++;
+}
+
+void draw_run(const DrawRun *r, int pair){
+    attrset(COLOR_PAIR(pair));
+    for(int i=0;i<r->n;i++)
+        mvaddch(r->cells[i].y,r->cells[i].x,r->cells[i].ch);
+}
+
+/* Particles go first so entities stay on top. They share the shot pair,
+   which is also the background pair, so they need no SGR switch. */
+void draw_entities(const Frame *f){
+    draw_run(&f->runs[RUN_PARTICLE],BULLET_COLOR);
+
+    attrset(COLOR_PAIR(PLAYER_COLOR));
+    draw_sprite(&sprites[SPR_PLAYER],f->player.x,f->player.y);
+
+    draw_run(&f->runs[RUN_ENEMY],ENEMY_COLOR);
+    draw_run(&f->runs[RUN_SHOT],BULLET_COLOR);
+    draw_run(&f->runs[RUN_ENEMY_SHOT],ENEMY_BULLET_COLOR);
+}
+
+/* erase() rather than clear(): clear() forces curses to repaint every cell */
+void render_frame(const Frame *f){
+    erase();
+    draw_hud(f);
+    draw_entities(f);
+    if(f->rewinding){
+        attrset(COLOR_PAIR(TEXT_COLOR));
+        mvprintw(max_y/2,max_x/2-5,"<< REWIND");
+    }
+    else if(f->paused){
+        attrset(COLOR_PAIR(TEXT_COLOR));
+        mvprintw(max_y/2,max_x/2-5,"PAUSED");
+    }
+    attrset(A_NORMAL);
+    if(bw_budget) budget_frame(f);
+    refresh();
+    note_first_frame();
+    if(zsess) zs_feed(zsess,NULL,0,Z_SYNC_FLUSH);
+
+    out_frame_bytes=out_bytes-out_mark_bytes;
+    out_frame_sgr=out_sgr_bytes-out_mark_sgr;
+    out_mark_bytes=out_bytes;
+    out_mark_sgr=out_sgr_bytes;
+    if(bw_budget){
+        bw_tokens-=out_frame_bytes;
+        bw_bytes_total+=out_frame_bytes;
+        if(bw_sent) bw_cell_cost=0.75*bw_cell_cost+0.25*out_frame_bytes/bw_sent;
     }
 }
 
-void draw_entities(){
-    attron(COLOR_PAIR(PLAYER_COLOR));
-    mvprintw(player.y,player.x-1,"<^>");
-    attroff(COLOR_PAIR(PLAYER_COLOR));
+/* -------- FRAME HANDOFF -------- */
+/* Entities are snapped to cells and aggregated per cell, enemies with
+   every cell of their sprite. A cell with one entity keeps its glyph; overlapping cells show a density glyph in the
+   color of the most important kind present (enemy, then enemy shot, then
+   player shot). Live particles follow in their own run. The runs live in
+   the frame's own arena, sized for every cell (or every particle), so
+   filling them never checks capacity. */
+void snapshot_frame(Frame *f){
+    if(!f->arena.base) arena_init(&f->arena,FRAME_ARENA_RESERVE);
+    arena_reset(&f->arena);
+    for(int r=0;r<NUM_RUNS;r++){
+        size_t cap=r==RUN_PARTICLE?PARTICLE_CAP:(size_t)max_x*max_y;
+        f->runs[r].n=0;
+        f->runs[r].cells=arena_alloc(&f->arena,sizeof(DrawCell)*cap);
+    }
+
+    for(int i=0;i<enemies.n;i++){
+        const Sprite *sp=&sprites[enemies.kind[i]];
+        int c0=(CELL(enemies.y[i])-sp->ay)*max_x+CELL(enemies.x[i])-sp->ax;
+        for(int r=0;r<sp->h;r++)
+            for(uint32_t m=sp->mask[r];m;m&=m-1){
+                int col=__builtin_ctz(m),c=c0+r*max_x+col;
+                cell_count[c]++;
+                cell_kind[c]|=1<<RUN_ENEMY;
+                cell_glyph[c]=sp->art[r][col];
+            }
+    }
+    for(int i=0;i<bullets.n;i++){
+        int c=CELL(bullets.y[i])*max_x+CELL(bullets.x[i]);
+        int up=bullets.dy[i]<0;
+        cell_count[c]++;
+        cell_kind[c]|=1<<(up?RUN_SHOT:RUN_ENEMY_SHOT);
+        cell_glyph[c]=up?'|':'!';
+    }
+
+    for(int c=0;c<max_x*max_y;c++){
+        if(!cell_count[c]) continue;
+        int kind=cell_kind[c]&(1<<RUN_ENEMY)?RUN_ENEMY:
+                 cell_kind[c]&(1<<RUN_ENEMY_SHOT)?RUN_ENEMY_SHOT:RUN_SHOT;
+        int n=cell_count[c];
+        chtype ch=n==1?cell_glyph[c]:n<4?':':n<8?'*':n<16?'#':'@';
+        DrawRun *r=&f->runs[kind];
+        r->cells[r->n++]=(DrawCell){ c%max_x, c/max_x, ch };
+        cell_count[c]=0;
+        cell_kind[c]=0;
+    }
+
+    DrawRun *pr=&f->runs[RUN_PARTICLE];
+    for(unsigned k=particles.tail;k!=particles.head;k++){
+        int i=k&(PARTICLE_CAP-1);
+        int life=particles.kind[i]==PARTICLE_FLASH?FLASH_LIFE:DEBRIS_LIFE;
+        int x=CELL(particles.x[i]),y=CELL(particles.y[i]);
+        if(particles.age[i]>=life||y<2||y>=max_y-2||x<0||x>=max_x) continue;
+        chtype ch=particles.kind[i]==PARTICLE_FLASH?'*':particles.age[i]<life/2?'+':'.';
+        pr->cells[pr->n++]=(DrawCell){ x, y, ch };
+    }
 
-    Enemy *e=enemies;
-    attron(COLOR_PAIR(ENEMY_COLOR));
-    while(e){
-        mvaddch(e->y,e->x,'W');
-        e=e->next;
+    f->tick=sim_tick;
+    f->skipped=frames_skipped;
+    f->player=player;
+    f->paused=paused;
+    f->rewinding=now_ns()<rewind_until;
+    f->n_enemies=enemies.n;
+    f->n_bullets=bullets.n;
+    f->sim_ns=sim_ns;
+    f->tps=tps_last;
+    if(mem_stats){
+        f->heap_tick=heap_tick_calls;
+        f->heap_live=heap_live;
+        f->rss_kb=peak_rss_kb();
     }
-    attroff(COLOR_PAIR(ENEMY_COLOR));
+}
+
+/* Swap the finished back buffer into the middle slot. If the previous
+   frame there was never picked up, it is dropped. */
+void publish_frame(){
+    int prev=atomic_exchange(&tb_mid,tb_back|TB_FRESH);
+    if(prev&TB_FRESH) frames_skipped++;
+    tb_back=prev&~TB_FRESH;
+    frames_published++;
+}
 
-    Bullet *b=bullets;
-    while(b){
-        if(b->dy<0){
-            attron(COLOR_PAIR(BULLET_COLOR));
-            mvaddch(b->y,b->x,'|');
-            attroff(COLOR_PAIR(BULLET_COLOR));
+/* Take the newest published frame, or NULL if none arrived since last time */
+Frame *acquire_frame(){
+    if(!(atomic_load(&tb_mid)&TB_FRESH)) return NULL;
+    int prev=atomic_exchange(&tb_mid,tb_front);
+    tb_front=prev&~TB_FRESH;
+    return &frames[tb_front];
+}
+
+void *render_main(void *arg){
+    (void)arg;
+    while(atomic_load(&render_running)){
+        Frame *f=acquire_frame();
+        if(f){
+            render_frame(f);
+            frames_rendered++;
         } else {
-            attron(COLOR_PAIR(ENEMY_BULLET_COLOR));
-            mvaddch(b->y,b->x,'!');
-            attroff(COLOR_PAIR(ENEMY_BULLET_COLOR));
+            frames_duplicated++;
         }
-        b=b->next;
+        usleep(frame_ns/1000);
     }
+    return NULL;
 }
 
-void process_input(){
-    int ch;
-    while((ch=getch())!=ERR){
-        if(ch==KEY_LEFT && player.x>2) player.x-=2;
-        else if(ch==KEY_RIGHT && player.x<max_x-3) player.x+=2;
-        else if(ch==' ') add_bullet(player.x,player.y-1,-1);
-        else if(ch=='p'||ch=='P') paused=!paused;
-        else if(ch=='q'||ch=='Q') game_over=1;
+void start_render_thread(){
+    atomic_store(&render_running,1);
+    pthread_create(&render_tid,NULL,render_main,NULL);
+}
+
+void stop_render_thread(){
+    atomic_store(&render_running,0);
+    pthread_join(render_tid,NULL);
+}
+
+/* -------- INPUT -------- */
+long long now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+/* End of a tick: count it towards the rate, then sleep until the next
+   one is due */
+void pace_tick(){
+    long long now=now_ns();
+    tps_count++;
+    if(now-tps_window>=1000000000LL){
+        tps_last=tps_count;
+        if(!tps_min || tps_count<tps_min) tps_min=tps_count;
+        tps_count=0;
+        tps_window+=1000000000LL;
+        if(now-tps_window>=1000000000LL) tps_window=now;
+    }
+    if(!tick_ns) return;
+    next_tick_at+=tick_ns;
+    if(next_tick_at<now-PACE_SLACK*tick_ns) next_tick_at=now;
+    else if(next_tick_at>now){
+        struct timespec ts={ next_tick_at/1000000000LL, next_tick_at%1000000000LL };
+        clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&ts,NULL);
     }
 }
 
-void check_collisions(){
-    Bullet *b=bullets,*bprev=NULL;
-    while(b){
-        if(b->dy<0){
-            Enemy *e=enemies,*eprev=NULL;
-            while(e){
-                if(e->y==b->y && abs(e->x-b->x)<=1){
-                    player.score+=10;
-                    Enemy *etmp=e;
-                    e=e->next;
-                    remove_enemy(eprev,etmp);
-                    Bullet *btmp=b;
-                    b=b->next;
-                    remove_bullet(bprev,btmp);
-                    goto nextbullet;
-                }
-                eprev=e;
-                e=e->next;
-            }
-        } else {
-            if(b->y==player.y && abs(b->x-player.x)<=1){
-                player.lives--;
-                Bullet *btmp=b;
-                b=b->next;
-                remove_bullet(bprev,btmp);
-                if(player.lives<=0) game_over=1;
+/* Should this tick be drawn? Always, unless ticks run faster than the
+   render cap; then only once the cap's interval is up. */
+int frame_due(long long now){
+    if(tick_ns && tick_ns>=frame_ns) return 1;
+    if(now<next_frame_at) return 0;
+    next_frame_at+=frame_ns;
+    if(next_frame_at<=now) next_frame_at=now+frame_ns;
+    return 1;
+}
+
+/* Decode one key from raw tty bytes. Returns bytes consumed, or 0 if the
+   buffer holds only the start of an escape sequence. */
+int decode_key(const unsigned char *buf, int len, int *key){
+    if(buf[0]!=27){ *key=buf[0]=='\r'?'\n':buf[0]; return 1; }
+    if(len<2) return 0;
+    if(buf[1]!='['&&buf[1]!='O'){ *key=27; return 1; }
+    if(len<3) return 0;
+    switch(buf[2]){
+        case 'A': *key=KEY_UP; break;
+        case 'B': *key=KEY_DOWN; break;
+        case 'C': *key=KEY_RIGHT; break;
+        case 'D': *key=KEY_LEFT; break;
+        default: *key=ERR; break;
+    }
+    return 3;
+}
+
+void *input_main(void *arg){
+    (void)arg;
+    unsigned char buf[64];
+    int len=0;
+    struct pollfd pfd={ .fd=STDIN_FILENO, .events=POLLIN };
+    while(atomic_load(&input_running)){
+        /* an unfinished escape sequence is dropped if nothing follows it */
+        int ready=poll(&pfd,1,50);
+        if(ready<=0){
+            len=0;
+            continue;
+        }
+        int n=read(STDIN_FILENO,buf+len,sizeof(buf)-len);
+        if(n<=0) continue;
+        len+=n;
+
+        long long t=now_ns();
+        unsigned long tick=atomic_load_explicit(&sim_tick,memory_order_relaxed);
+        int off=0,used,key;
+        while(off<len && (used=decode_key(buf+off,len-off,&key))>0){
+            off+=used;
+            if(key==ERR) continue;
+            unsigned head=atomic_load_explicit(&inputq_head,memory_order_relaxed);
+            if(head-atomic_load_explicit(&inputq_tail,memory_order_acquire)==INPUTQ_SIZE){
+                keys_dropped++;
                 continue;
             }
+            inputq[head%INPUTQ_SIZE]=(KeyEvent){ key, tick, t };
+            atomic_store_explicit(&inputq_head,head+1,memory_order_release);
         }
-        bprev=b;
-        b=b->next;
-        nextbullet:;
+        memmove(buf,buf+off,len-off);
+        len-=off;
     }
+    return NULL;
 }
 
-void remove_enemy(Enemy *prev, Enemy *e){
-    if(!prev) enemies=e->next;
-    else prev->next=e->next;
-    free(e);
+void start_input_thread(){
+    atomic_store(&input_running,1);
+    pthread_create(&input_tid,NULL,input_main,NULL);
 }
 
-void remove_bullet(Bullet *prev, Bullet *b){
-    if(!prev) bullets=b->next;
-    else prev->next=b->next;
-    free(b);
+void stop_input_thread(){
+    atomic_store(&input_running,0);
+    pthread_join(input_tid,NULL);
 }
 
-void clear_lists(){
-    Enemy *e=enemies;
-    while(e){Enemy *n=e->next;free(e);e=n;}
-    Bullet *b=bullets;
-    while(b){Bullet *n=b->next;free(b);b=n;}
+int next_key(KeyEvent *ev){
+    unsigned tail=atomic_load_explicit(&inputq_tail,memory_order_relaxed);
+    if(tail==atomic_load_explicit(&inputq_head,memory_order_acquire)) return 0;
+    *ev=inputq[tail%INPUTQ_SIZE];
+    atomic_store_explicit(&inputq_tail,tail+1,memory_order_release);
+
+    /* Keys are drained at the start of a tick, so one that arrived during
+       tick t is applied at t+1 and one that arrived between ticks at once:
+       a lag of 0 or 1. A rewind winds sim_tick back past queued keys. */
+    long long lat=now_ns()-ev->t_ns;
+    unsigned long tick=sim_tick,lag=tick>ev->tick?tick-ev->tick:0;
+    input_lat_sum+=lat;
+    if(lat>input_lat_max) input_lat_max=lat;
+    input_lag_sum+=lag;
+    if(lag>input_lag_max) input_lag_max=lag;
+    keys_applied++;
+    return 1;
 }
 
+void process_input(){
+    KeyEvent ev;
+    while(next_key(&ev)){
+        int ch=ev.key;
+        if(ch==KEY_LEFT||ch==KEY_RIGHT||ch==' '){
+            apply_key(ch);
+            if(replay_out) replay_key(ch);
+            if(rewind_on) rewind_key(ch);
+        }
+        else if((ch=='r'||ch=='R') && rewind_on)
+            rewind_until=ev.t_ns+REWIND_HOLD_MS*1000000LL;
+        else if(ch=='p'||ch=='P') paused=!paused;
+        else if(ch=='q'||ch=='Q') game_over=1;
+    }
+}
+
+/* The keys that change the simulation; replays hold only these */
+void apply_key(int ch){
+    if(ch==KEY_LEFT && player.x>2) player.x-=2;
+    else if(ch==KEY_RIGHT && player.x<max_x-3) player.x+=2;
+    else if(ch==' ') add_bullet(FX(player.x),FX(player.y-1),0,-shot_vy);
+}
+
+/* Chain every live enemy into its anchor cell, and mark every cell its
+   sprite's hitbox passed through this tick as swept */
+void build_grid(){
+    enemy_next=arena_alloc(&tick_arena,sizeof(int)*enemies.n);
+    memset(grid_head,0xff,sizeof(int)*max_x*max_y);
+    memset(sweep_occ,0,max_x*max_y);
+    for(int i=0;i<enemies.n;i++){
+        if(enemies.y[i]<0) continue;
+        const Sprite *sp=&sprites[enemies.kind[i]];
+        int x=CELL(enemies.x[i]),y=CELL(enemies.y[i]);
+        int c=y*max_x+x;
+        enemy_next[i]=grid_head[c];
+        grid_head[c]=i;
+        int left=x-sp->ax-1;
+        for(int sr=0;sr<sp->h;sr++)
+            for(int r=CELL(enemies.py[i])-sp->ay+sr;r<=y-sp->ay+sr;r++){
+                unsigned char *o=&sweep_occ[r*max_x+left];
+                for(uint32_t m=sp->hit[sr];m;m&=m-1) o[__builtin_ctz(m)]=1;
+            }
+    }
+}
+
+/* Does live enemy e's hitbox, swept over this tick, cross column x
+   between rows y1 (top) and y0? Sprite row r covers rows top0+r down to
+   top1+r, so the rows that can reach the span are a contiguous range and
+   the test is one lookup in the column's row mask. */
+int enemy_swept_hit(int e,int x,int y0,int y1){
+    const Sprite *sp=&sprites[enemies.kind[e]];
+    int c=x-(CELL(enemies.x[e])-sp->ax)+1;
+    if(c<0||c>sp->w+1) return 0;
+    int top0=CELL(enemies.py[e])-sp->ay,top1=CELL(enemies.y[e])-sp->ay;
+    int r0=y1-top1,r1=y0-top0;
+    if(r0<0) r0=0;
+    if(r1>=sp->h) r1=sp->h-1;
+    if(r0>r1) return 0;
+    return (sp->cols[c]>>r0)&((2u<<(r1-r0))-1);
+}
+
+/* Live enemy whose path this tick crosses up-shot i's path, or -1.
+   Both move vertically over the same interval, so they meet iff the shot
+   starts at or below the top of the enemy's sweep and ends at or above
+   its bottom. An enemy that could meet the shot is anchored within the
+   sprites' reach of the shot's path, or enemy_rows_max further down. */
+int find_enemy_swept(int i){
+    int x=CELL(bullets.x[i]),y0=CELL(bullets.y[i]),y1=CELL(bullets.y[i]+bullets.dy[i]);
+    int lo=y1+reach_y0,hi=y0+reach_y1+enemy_rows_max;
+    if(lo<0) lo=0;
+    if(hi>=max_y) hi=max_y-1;
+    for(int r=lo;r<=hi;r++)
+        for(int cx=x+reach_x0;cx<=x+reach_x1;cx++){
+            if(cx<0||cx>=max_x) continue;
+            for(int e=grid_head[r*max_x+cx];e>=0;e=enemy_next[e])
+                if(enemies.y[e]>=0 && enemy_swept_hit(e,x,y0,y1)) return e;
+        }
+    return -1;
+}
+
+/* Does down-shot i cross a drawn cell of the player's sprite this tick? */
+int player_hit(int i){
+    const Sprite *sp=&sprites[SPR_PLAYER];
+    int c=CELL(bullets.x[i])-(player.x-sp->ax);
+    if(c<0||c>=sp->w) return 0;
+    int y0=CELL(bullets.y[i]),y1=CELL(bullets.y[i]+bullets.dy[i]);
+    for(int r=0;r<sp->h;r++){
+        int row=player.y-sp->ay+r;
+        if(y0<=row && row<=y1 && (sp->mask[r]>>c&1)) return 1;
+    }
+    return 0;
+}
+
+/* One row band's candidates. Only reads shared state, so bands can run in
+   any order on any thread; the first enemy each shot reaches is recorded
+   for the serial merge. */
+void resolve_band(int b){
+    for(int k=stripe_start[b];k<stripe_start[b+1];k++){
+        int c=stripe_order[k];
+        int i=hit_cand[c];
+        cand_hit[c]=bullets.dy[i]<0?find_enemy_swept(i):-1;
+    }
+}
+
+/* Swept collision over the tick: bullets are tested along the move they
+   are about to make, so a shot and an enemy that swap rows still meet.
+   The kernel flags candidates; bands find their targets in parallel and
+   the hits are applied in candidate order. If an earlier shot already
+   took that enemy, the search is redone against what is left. */
+void check_collisions(){
+    build_grid();
+    hit_cand=arena_alloc(&tick_arena,sizeof(int)*bullets.n);
+    int n=kern->hits(hit_cand);
+
+    cand_hit=arena_alloc(&tick_arena,sizeof(int)*n);
+    cand_y=arena_alloc(&tick_arena,sizeof(int)*n);
+    for(int k=0;k<n;k++) cand_y[k]=bullets.y[hit_cand[k]];
+    bucket_by(n,cand_y,FX_SHIFT,max_y);
+    run_jobs(resolve_band,NSTRIPES);
+
+    for(int k=0;k<n;k++){
+        int i=hit_cand[k];
+        if(bullets.dy[i]>0){
+            if(stress || !player_hit(i)) continue;
+            spawn_explosion(bullets.x[i],bullets.y[i]);
+            destroy_bullet(i);
+            player.lives--;
+            continue;
+        }
+        int e=cand_hit[k];
+        if(e>=0 && enemies.y[e]<0) e=find_enemy_swept(i);
+        if(e<0) continue;
+        spawn_explosion(enemies.x[e],enemies.y[e]);
+        if(!stress) LOG(LOG_HIT,(long)enemies.id[e],enemies.kind[e],CELL(enemies.x[e]),CELL(enemies.y[e]));
+        player.score+=sprites[enemies.kind[e]].points;
+        destroy_enemy(e);
+        destroy_bullet(i);
+    }
+    if(player.lives<=0) game_over=1;
+}
+
+/* Order-preserving removal of enemies marked dead (y=-1); their handles
+   are released and the survivors' slots repointed */
+void compact_enemies(){
+    if(!enemies_dead) return;
+    int w=0;
+    for(int i=0;i<enemies.n;i++){
+        if(enemies.y[i]<0){
+            reg_free(&enemy_reg,enemies.id[i]);
+            continue;
+        }
+        enemies.x[w]=enemies.x[i];
+        enemies.y[w]=enemies.y[i];
+        enemies.py[w]=enemies.py[i];
+        enemies.vy[w]=enemies.vy[i];
+        enemies.kind[w]=enemies.kind[i];
+        enemies.script[w]=enemies.script[i];
+        enemies.pc[w]=enemies.pc[i];
+        enemies.ctr[w]=enemies.ctr[i];
+        enemies.id[w]=enemies.id[i];
+        enemy_reg.slots[HANDLE_SLOT(enemies.id[w])].dense=w;
+        w++;
+    }
+    enemies.n=w;
+    enemies_dead=0;
+}
+
+/* Apply the tick's deferred removals and drop its transient data. The
+   bullet kernels already dropped culled and destroyed bullets (releasing
+   their handles) while moving the rest, so only the slot map needs
+   catching up. */
+void end_tick(){
+    compact_enemies();
+    reg_reindex(&bullet_reg,bullets.id,bullets.n);
+    arena_reset(&tick_arena);
+}
+
+/* -------- SCRIPTS -------- */
+void timer_reset(){
+    for(int k=0;k<WHEEL_SLOTS;k++) wheel.head[k]=-1;
+    wheel.n=0;
+    wheel.free=-1;
+    wave=(Wave){ 0 };
+}
+
+/* Wake h in ticks (at least 1) */
+void timer_add(Handle h,int ticks){
+    int k=wheel.free;
+    if(k>=0) wheel.free=wheel.t[k].next;
+    else {
+        if(wheel.n==wheel.cap){
+            wheel.cap=wheel.cap?wheel.cap*2:64;
+            wheel.t=xrealloc(wheel.t,sizeof(Timer)*wheel.cap);
+        }
+        k=wheel.n++;
+    }
+    unsigned long when=sim_tick+ticks;
+    int *slot=&wheel.head[when&(WHEEL_SLOTS-1)];
+    wheel.t[k]=(Timer){ h, when, *slot };
+    *slot=k;
+}
+
+/* Resume everything due this tick. Only the current slot is visited, so
+   sleeping scripts cost nothing; nodes due on a later lap stay in it.
+   Runs serially before the enemy update, so scripts may move, retime and
+   spawn enemies freely, and the order (the slot's list order) is the
+   same on every run. */
+void run_timers(){
+    int *slot=&wheel.head[sim_tick&(WHEEL_SLOTS-1)];
+    int k=*slot,*keep=slot,due=-1,*dtail=&due;
+    while(k>=0){
+        int next=wheel.t[k].next;
+        if(wheel.t[k].when>sim_tick){ *keep=k; keep=&wheel.t[k].next; }
+        else { *dtail=k; dtail=&wheel.t[k].next; }
+        k=next;
+    }
+    *keep=*dtail=-1;
+    for(k=due;k>=0;){
+        Handle h=wheel.t[k].h;
+        int next=wheel.t[k].next;
+        wheel.t[k].next=wheel.free;
+        wheel.free=k;
+        k=next;
+
+        int wait;
+        if(h==HANDLE_NONE){
+            wait=script_waves();
+            LOG(LOG_WAVE,(long)sim_tick,wait,0,0);
+        }
+        else {
+            int e=reg_lookup(&enemy_reg,h);
+            if(e<0 || enemies.y[e]<0) continue;
+            wait=run_script(e);
+        }
+        if(wait>0) timer_add(h,wait);
+    }
+}
+
+/* Step enemy e's script; ticks until it wants to run again, or -1.
+   Scripts change the path, so the enemy is rekeyed around the step. */
+int run_script(int e){
+    int wait=-1;
+    zhash^=enemy_key(e,zh_enemy_pass);
+    switch(enemies.script[e]){
+        case SCRIPT_WEAVE: wait=script_weave(e); break;
+        case SCRIPT_DIVE: wait=script_dive(e); break;
+    }
+    zhash^=enemy_key(e,zh_enemy_pass);
+    return wait;
+}
+
+/* Move one column sideways, turning back at the edges of the spawn band */
+void enemy_sidestep(int e,int dx){
+    int x=CELL(enemies.x[e])+dx;
+    if(x>=2 && x<=max_x-3) enemies.x[e]+=FX(dx);
+}
+
+/* Sidesteps are whole columns between ticks, so within a tick every enemy
+   still moves straight down, which the swept collision relies on. ctr
+   counts the steps of one full swing. */
+int script_weave(int e){
+    CO_BEGIN(enemies.pc[e]);
+    for(;;){
+        CO_WAIT(enemies.pc[e],WEAVE_TICKS);
+        enemy_sidestep(e,enemies.ctr[e]<WEAVE_STEPS?1:-1);
+        enemies.ctr[e]=(enemies.ctr[e]+1)%(2*WEAVE_STEPS);
+    }
+    CO_END(enemies.pc[e]);
+}
+
+int script_dive(int e){
+    CO_BEGIN(enemies.pc[e]);
+    enemies.vy[e]=enemy_vy/2;
+    CO_WAIT(enemies.pc[e],DIVE_DRIFT_TICKS);
+    enemies.vy[e]=0;
+    CO_WAIT(enemies.pc[e],DIVE_HOVER_TICKS);
+    enemies.vy[e]=enemy_vy*DIVE_BOOST;
+    CO_END(enemies.pc[e]);
+}
+
+/* The wave director: stragglers at the old spawn rate, then a V of
+   weavers, more stragglers, then a line of divers sweeping across */
+int script_waves(){
+    CO_BEGIN(wave.pc);
+    for(;;){
+        for(wave.n=0;wave.n<WAVE_STRAGGLERS;wave.n++){
+            spawn_enemy();
+            CO_WAIT(wave.pc,spawn_ticks);
+        }
+
+        /* a field too narrow for the V and its weave skips it */
+        if(max_x-4-4*VEE_SIZE>0){
+            wave.x=rng_range(&sim_rng,max_x-4-4*VEE_SIZE)+2+2*VEE_SIZE;
+            for(int k=0;k<VEE_SIZE;k++){
+                int d=k-VEE_SIZE/2,side=d<0?-d:d;
+                add_scripted(FX(wave.x+3*d),FX(3+VEE_SIZE/2-side),SPR_GRUNT,
+                             SCRIPT_WEAVE,WEAVE_STEPS/2);
+            }
+        }
+        CO_WAIT(wave.pc,2*spawn_ticks);
+
+        for(wave.n=0;wave.n<WAVE_STRAGGLERS;wave.n++){
+            spawn_enemy();
+            CO_WAIT(wave.pc,spawn_ticks);
+        }
+
+        for(wave.n=0;wave.n<LINE_SIZE;wave.n++){
+            add_scripted(FX(4+wave.n*(max_x-8)/(LINE_SIZE-1)),FX(3),SPR_GRUNT,SCRIPT_DIVE,0);
+            CO_WAIT(wave.pc,LINE_GAP_TICKS);
+        }
+        CO_WAIT(wave.pc,2*spawn_ticks);
+    }
+    CO_END(wave.pc);
+}
+
+/* -------- SPRITES -------- */
+/* Compile every sprite's art into its row and column masks, and the
+   enemies' reach for the broadphase */
+void init_sprites(){
+    reach_x0=reach_x1=reach_y0=reach_y1=0;
+    for(int k=0;k<NUM_SPRITES;k++){
+        Sprite *sp=&sprites[k];
+        sp->w=sp->h=0;
+        memset(sp->cols,0,sizeof(sp->cols));
+        for(int r=0;r<SPRITE_MAX_H && sp->art[r];r++){
+            uint32_t m=0;
+            for(int c=0;sp->art[r][c];c++)
+                if(sp->art[r][c]!=' ') m|=1u<<c;
+            int w=(int)strlen(sp->art[r]);
+            if(w>sp->w) sp->w=w;
+            sp->mask[r]=m;
+            sp->hit[r]=m|m<<1|m<<2;
+            for(uint32_t b=sp->hit[r];b;b&=b-1) sp->cols[__builtin_ctz(b)]|=1u<<r;
+            sp->h=r+1;
+        }
+        if(k==SPR_PLAYER) continue;
+        if(sp->ax-sp->w<reach_x0) reach_x0=sp->ax-sp->w;
+        if(sp->ax+1>reach_x1) reach_x1=sp->ax+1;
+        if(sp->ay-sp->h+1<reach_y0) reach_y0=sp->ay-sp->h+1;
+        if(sp->ay>reach_y1) reach_y1=sp->ay;
+    }
+}
+
+/* Drawn cells only, so blanks in the art leave what is behind them */
+void draw_sprite(const Sprite *sp,int x,int y){
+    for(int r=0;r<sp->h;r++)
+        for(uint32_t m=sp->mask[r];m;m&=m-1){
+            int c=__builtin_ctz(m);
+            mvaddch(y-sp->ay+r,x-sp->ax+c,sp->art[r][c]);
+        }
+}
+
+/* -------- ARENA -------- */
+void arena_init(Arena *a, size_t reserve){
+    a->base=mmap(NULL,reserve,PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    if(a->base==MAP_FAILED){
+        perror("mmap");
+        exit(1);
+    }
+    a->cap=reserve;
+    a->used=a->peak=0;
+}
+
+/* 64-byte aligned, so vector loads and stripe buffers never share a line */
+void *arena_alloc(Arena *a, size_t n){
+    size_t off=(a->used+63)&~(size_t)63;
+    if(off+n>a->cap){
+        fprintf(stderr,"arena exhausted (%zu bytes reserved)\n",a->cap);
+        abort();
+    }
+    a->used=off+n;
+    if(a->used>a->peak) a->peak=a->used;
+    return a->base+off;
+}
+
+void arena_reset(Arena *a){
+    a->used=0;
+}
+
+void arena_release(Arena *a){
+    if(a->base) munmap(a->base,a->cap);
+    memset(a,0,sizeof(*a));
+}
+
+/* -------- HEAP ACCOUNTING -------- */
+/* Every heap call in the game goes through these (as xmalloc() etc.) */
+void *heap_malloc(size_t n, const char *site){
+    void *p=malloc(n);
+    heap_calls++;
+    if(mem_stats) heap_note(site,malloc_usable_size(p));
+    return p;
+}
+
+void *heap_calloc(size_t n, size_t size, const char *site){
+    void *p=calloc(n,size);
+    heap_calls++;
+    if(mem_stats) heap_note(site,malloc_usable_size(p));
+    return p;
+}
+
+void *heap_realloc(void *p, size_t n, const char *site){
+    size_t old=mem_stats?malloc_usable_size(p):0;
+    p=realloc(p,n);
+    heap_calls++;
+    if(mem_stats){
+        heap_live-=old;
+        heap_note(site,malloc_usable_size(p));
+    }
+    return p;
+}
+
+void heap_free(void *p, const char *site){
+    if(!p) return;
+    heap_calls++;
+    if(mem_stats){
+        heap_live-=malloc_usable_size(p);
+        heap_note(site,0);
+    }
+    free(p);
+}
+
+/* Count a call at site that left bytes newly live */
+void heap_note(const char *site, size_t bytes){
+    heap_live+=bytes;
+    if(heap_live>heap_peak) heap_peak=heap_live;
+    int i=0;
+    while(i<n_heap_sites && heap_sites[i].site!=site) i++;
+    if(i==n_heap_sites){
+        if(n_heap_sites==HEAP_SITES) return;
+        heap_sites[n_heap_sites++]=(HeapSite){ site, 0, 0 };
+    }
+    heap_sites[i].calls++;
+    heap_sites[i].bytes+=bytes;
+}
+
+long peak_rss_kb(){
+    struct rusage ru;
+    getrusage(RUSAGE_SELF,&ru);
+    return ru.ru_maxrss;
+}
+
+static int by_calls(const void *a, const void *b){
+    const HeapSite *x=a,*y=b;
+    return (y->calls>x->calls)-(y->calls<x->calls);
+}
+
+/* Printed after teardown, so live bytes left over are leaks */
+void print_heap_report(){
+    if(!mem_stats) return;
+    printf("Heap: %lu calls, max %lu in one tick, live %zu KB (peak %zu KB), peak RSS %ld KB\n",
+           heap_calls,heap_tick_max,heap_live>>10,heap_peak>>10,peak_rss_kb());
+    qsort(heap_sites,n_heap_sites,sizeof(HeapSite),by_calls);
+    for(int i=0;i<n_heap_sites;i++)
+        printf("  %-20s %8lu calls %10zu KB\n",heap_sites[i].site,
+               heap_sites[i].calls,heap_sites[i].bytes>>10);
+}
+
+/* -------- ENTITY REGISTRY -------- */
+Handle reg_alloc(Registry *r, int idx){
+    int s;
+    if(r->free_head!=r->free_tail){
+        s=r->free_q[r->free_head++&(r->cap-1)];
+    } else {
+        if(r->n_slots==r->cap){
+            /* the ring is empty whenever the registry grows */
+            reg_reserve(r,r->cap?r->cap*2:64);
+            r->free_head=r->free_tail=0;
+        }
+        s=r->n_slots++;
+        r->slots[s].gen=1;
+    }
+    r->slots[s].dense=idx;
+    return (Handle)r->slots[s].gen<<HANDLE_SLOT_BITS|s;
+}
+
+void reg_reserve(Registry *r, int cap){
+    r->cap=cap;
+    r->slots=xrealloc(r->slots,sizeof(RegSlot)*cap);
+    r->free_q=xrealloc(r->free_q,sizeof(int)*cap);
+}
+
+void reg_free(Registry *r, Handle h){
+    int s=HANDLE_SLOT(h);
+    unsigned g=(r->slots[s].gen+1)&HANDLE_GEN_MASK;
+    r->slots[s]=(RegSlot){ -1, g?g:1 };
+    r->free_q[r->free_tail++&(r->cap-1)]=s;
+}
+
+/* Pool index of a handle's entity, or -1 once it has been removed */
+int reg_lookup(const Registry *r, Handle h){
+    int s=HANDLE_SLOT(h);
+    if(s>=r->n_slots || r->slots[s].gen!=HANDLE_GEN(h)) return -1;
+    return r->slots[s].dense;
+}
+
+/* Repoint every live slot after its pool was compacted */
+void reg_reindex(Registry *r, const Handle *id, int n){
+    for(int i=0;i<n;i++) r->slots[HANDLE_SLOT(id[i])].dense=i;
+}
+
+void reg_reset(Registry *r){
+    r->n_slots=0;
+    r->free_head=r->free_tail=0;
+}
+
+void reg_release(Registry *r){
+    xfree(r->slots); xfree(r->free_q);
+    memset(r,0,sizeof(*r));
+}
+
+/* Per-second difficulty for a menu level (4 is Stress) */
+void set_level(int level){
+    switch(level) {
+        case 1: /* EASY */
+            spawn_interval = 3.2;
+            enemy_speed = 2.1;
+            enemy_fire_rate = 0.0625;
+            break;
+        case 2: /* MEDIUM */
+            spawn_interval = 2.0;
+            enemy_speed = 3.1;
+            enemy_fire_rate = 0.125;
+            break;
+        case 3: /* HARD */
+            spawn_interval = 1.0;
+            enemy_speed = 5.0;
+            enemy_fire_rate = 0.31;
+            break;
+        case 4: /* STRESS */
+            stress = 1;
+            enemy_speed = 25.0;
+            break;
+    }
+    set_tick_rates();
+}
+
+/* Also zeroes the lists, so init_game() can start another game */
+void clear_lists(){
+    xfree(enemies.x); xfree(enemies.y); xfree(enemies.py);
+    xfree(enemies.vy); xfree(enemies.kind); xfree(enemies.id);
+    xfree(enemies.script); xfree(enemies.pc); xfree(enemies.ctr);
+    xfree(wheel.t);
+    wheel.t=NULL;
+    wheel.cap=0;
+    xfree(bullets.x); xfree(bullets.y);
+    xfree(bullets.dx); xfree(bullets.dy); xfree(bullets.id);
+    reg_release(&enemy_reg); reg_release(&bullet_reg);
+    xfree(grid_head); xfree(sweep_occ);
+    xfree(cell_count); xfree(cell_kind); xfree(cell_glyph);
+    arena_release(&tick_arena);
+    memset(&enemies,0,sizeof(enemies));
+    memset(&bullets,0,sizeof(bullets));
+}
+
+/* -------- SIMULATION -------- */
+/* splitmix64 */
+uint64_t rng_next(uint64_t *s){
+    uint64_t z=(*s+=0x9e3779b97f4a7c15ULL);
+    z=(z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+    z=(z^(z>>27))*0x94d049bb133111ebULL;
+    return z^(z>>31);
+}
+
+/* Uniform in [0,n) */
+int rng_range(uint64_t *s, int n){
+    return (int)(((rng_next(s)>>32)*(uint64_t)n)>>32);
+}
+
+/* True with probability p/2^32 */
+int rng_chance(uint64_t *s, uint32_t p){
+    return (uint32_t)(rng_next(s)>>32)<p;
+}
+
+/* Convert the per-second difficulty into per-tick steps and chances */
+void set_tick_rates(){
+    spawn_ticks=(int)(spawn_interval*TICK_HZ+0.5);
+    enemy_vy=FX_PER_TICK(enemy_speed);
+    /* divers drop faster than anything else */
+    int fastest=stress?enemy_vy:enemy_vy*DIVE_BOOST;
+    enemy_rows_max=(fastest+FX_ONE-1)/FX_ONE;
+    enemy_fire_p=(uint32_t)(enemy_fire_rate/TICK_HZ*4294967296.0);
+    shot_vy=FX_PER_TICK(SHOT_SPEED);
+}
+
+/* One simulation tick. Collisions sweep each bullet along the move it is
+   about to make, so they run between the enemy and the bullet update. */
+void sim_step(){
+    if(stress) stress_spawn();
+    run_timers();
+
+    update_enemies();
+    check_collisions();
+    update_bullets();
+    update_particles();
+    end_tick();
+    sim_tick++;
+    if(hash_check) check_state_hash();
+
+    /* heap calls since the previous tick ended, input included */
+    heap_tick_calls=heap_calls-heap_tick_mark;
+    heap_tick_mark=heap_calls;
+    if(heap_tick_calls>heap_tick_max) heap_tick_max=heap_tick_calls;
+}
+
+/* FNV-1a over the whole simulation state */
+uint64_t state_checksum(){
+    uint64_t h=0xcbf29ce484222325ULL;
+#define MIX(p,len) for(size_t _i=0;_i<(size_t)(len);_i++){ h^=((const unsigned char*)(p))[_i]; h*=0x100000001b3ULL; }
+    MIX(&player,sizeof(player));
+    MIX(&enemies.n,sizeof(int));
+    MIX(enemies.x,sizeof(int)*enemies.n);
+    MIX(enemies.y,sizeof(int)*enemies.n);
+    MIX(enemies.py,sizeof(int)*enemies.n);
+    MIX(enemies.vy,sizeof(int)*enemies.n);
+    MIX(enemies.kind,enemies.n);
+    MIX(enemies.script,enemies.n);
+    MIX(enemies.pc,sizeof(unsigned short)*enemies.n);
+    MIX(enemies.ctr,enemies.n);
+    MIX(enemies.id,sizeof(Handle)*enemies.n);
+    MIX(&bullets.n,sizeof(int));
+    MIX(bullets.x,sizeof(int)*bullets.n);
+    MIX(bullets.y,sizeof(int)*bullets.n);
+    MIX(bullets.dx,sizeof(int)*bullets.n);
+    MIX(bullets.dy,sizeof(int)*bullets.n);
+    MIX(bullets.id,sizeof(Handle)*bullets.n);
+#undef MIX
+    return h;
+}
+
+/* -------- STATE HASH -------- */
+/* splitmix64 finalizer over two words */
+uint64_t zmix(uint64_t a,uint64_t b){
+    uint64_t z=a*0x9e3779b97f4a7c15ULL^b;
+    z=(z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+    z=(z^(z>>27))*0x94d049bb133111ebULL;
+    return z^(z>>31);
+}
+
+/* Key of enemy i as of the given number of enemy passes. The wind-back
+   is done in unsigned 32-bit arithmetic: it may wrap, but the same way
+   every time. */
+uint64_t enemy_key(int i,unsigned pass){
+    uint32_t y0=(uint32_t)enemies.y[i]-(uint32_t)enemies.vy[i]*pass;
+    uint64_t path=(uint64_t)(uint32_t)enemies.x[i]<<32|y0;
+    return zmix(zmix((uint64_t)enemies.id[i]<<8|enemies.kind[i],path),(uint32_t)enemies.vy[i]);
+}
+
+uint64_t bullet_key(int i){
+    uint32_t x0=(uint32_t)bullets.x[i]-(uint32_t)bullets.dx[i]*zh_bullet_pass;
+    uint32_t y0=(uint32_t)bullets.y[i]-(uint32_t)bullets.dy[i]*zh_bullet_pass;
+    uint64_t vel=(uint64_t)(uint32_t)bullets.dx[i]<<32|(uint32_t)bullets.dy[i];
+    return zmix(zmix((uint64_t)bullets.id[i]|1ULL<<63,(uint64_t)x0<<32|y0),vel);
+}
+
+/* The hash after the current tick, in O(1) */
+uint64_t state_hash(){
+    return zhash^zmix((uint64_t)(uint32_t)player.x<<32|(uint32_t)player.lives,(uint32_t)player.score);
+}
+
+/* The same from scratch, for -X */
+uint64_t state_hash_full(){
+    uint64_t h=0;
+    for(int i=0;i<enemies.n;i++)
+        if(enemies.y[i]>=0) h^=enemy_key(i,zh_enemy_pass);
+    for(int i=0;i<bullets.n;i++)
+        if(bullets.y[i]!=DEAD_Y) h^=bullet_key(i);
+    return h^zmix((uint64_t)(uint32_t)player.x<<32|(uint32_t)player.lives,(uint32_t)player.score);
+}
+
+void check_state_hash(){
+    hash_checked++;
+    if(state_hash()==state_hash_full()) return;
+    if(!hash_bad++) hash_first_bad=sim_tick;
+}
+
+/* A bullet the advance kernels leave behind: shots already destroyed
+   were unhashed then */
+void drop_bullet(int i){
+    if(bullets.y[i]!=DEAD_Y) zhash^=bullet_key(i);
+    reg_free(&bullet_reg,bullets.id[i]);
+}
+
+/* Stress simulation without a terminal; the checksum must not depend on -j.
+   The second half of the run is the steady state: it fails (exit 1) if
+   those ticks made any heap calls. */
+int run_headless(int ticks){
+    max_x=HEADLESS_W; max_y=HEADLESS_H;
+    stress=1;
+    enemy_speed=25.0;
+    set_tick_rates();
+    init_game();
+    unsigned long heap_mark=0;
+    long long t0=now_ns();
+    for(int t=0;t<ticks;t++){
+        if(t==ticks/2) heap_mark=heap_calls;
+        sim_step();
+    }
+    long long dt=now_ns()-t0;
+    unsigned long steady=heap_calls-heap_mark;
+    printf("seed %llu, %d ticks, %d threads: checksum %016llx hash %016llx score %d enemies %d bullets %d, %.3f ms/tick\n",
+           (unsigned long long)sim_seed,ticks,sim_threads,(unsigned long long)state_checksum(),
+           (unsigned long long)state_hash(),player.score,enemies.n,bullets.n,dt/1e6/ticks);
+    if(hash_check)
+        printf("hash check: %lu ticks, %lu mismatches (first at tick %lu)\n",
+               hash_checked,hash_bad,hash_first_bad);
+    printf("heap calls in steady state: %lu, tick arena peak %zu KB\n",steady,tick_arena.peak>>10);
+    clear_lists();
+    return steady?1:0;
+}
+
+/* Stable counting sort of n items into NSTRIPES buckets by
+   (key>>shift)/span; fills stripe_start[] and writes item indices to a
+   fresh stripe_order[] from the tick arena */
+void bucket_by(int n, const int *key, int shift, int span){
+    stripe_order=arena_alloc(&tick_arena,sizeof(int)*n);
+    int count[NSTRIPES+1]={0};
+    for(int i=0;i<n;i++){
+        int k=key[i]<0?0:(key[i]>>shift)*NSTRIPES/span;
+        count[k+1]++;
+    }
+    for(int s=0;s<NSTRIPES;s++) count[s+1]+=count[s];
+    memcpy(stripe_start,count,sizeof(count));
+    for(int i=0;i<n;i++){
+        int k=key[i]<0?0:(key[i]>>shift)*NSTRIPES/span;
+        stripe_order[count[k]++]=i;
+    }
+}
+
+void *pool_main(void *arg){
+    (void)arg;
+    int seen=0;
+    pthread_mutex_lock(&pool_mu);
+    while(1){
+        while(pool_gen==seen && !pool_quit) pthread_cond_wait(&pool_cv,&pool_mu);
+        if(pool_quit) break;
+        seen=pool_gen;
+        void (*fn)(int)=pool_fn;
+        int n=pool_jobs;
+        pthread_mutex_unlock(&pool_mu);
+
+        int j;
+        while((j=atomic_fetch_add(&pool_next,1))<n) fn(j);
+
+        pthread_mutex_lock(&pool_mu);
+        if(--pool_busy==0) pthread_cond_signal(&pool_done_cv);
+    }
+    pthread_mutex_unlock(&pool_mu);
+    return NULL;
+}
+
+void start_pool(){
+    if(sim_threads<=1) return;
+    pool_tids=xmalloc(sizeof(pthread_t)*(sim_threads-1));
+    for(int i=0;i<sim_threads-1;i++)
+        pthread_create(&pool_tids[i],NULL,pool_main,NULL);
+}
+
+void stop_pool(){
+    if(sim_threads<=1) return;
+    pthread_mutex_lock(&pool_mu);
+    pool_quit=1;
+    pthread_cond_broadcast(&pool_cv);
+    pthread_mutex_unlock(&pool_mu);
+    for(int i=0;i<sim_threads-1;i++) pthread_join(pool_tids[i],NULL);
+    xfree(pool_tids);
+}
+
+/* Run fn(0..n-1) across the pool; the calling thread takes jobs too */
+void run_jobs(void (*fn)(int), int n){
+    if(sim_threads<=1){
+        for(int j=0;j<n;j++) fn(j);
+        return;
+    }
+    pthread_mutex_lock(&pool_mu);
+    pool_fn=fn;
+    pool_jobs=n;
+    atomic_store(&pool_next,0);
+    pool_busy=sim_threads-1;
+    pool_gen++;
+    pthread_cond_broadcast(&pool_cv);
+    pthread_mutex_unlock(&pool_mu);
+
+    int j;
+    while((j=atomic_fetch_add(&pool_next,1))<n) fn(j);
+
+    pthread_mutex_lock(&pool_mu);
+    while(pool_busy) pthread_cond_wait(&pool_done_cv,&pool_mu);
+    pthread_mutex_unlock(&pool_mu);
+}
+
+/* -------- SIMD KERNELS -------- */
+/* Bullets stay while their cell is inside the playfield rows 3..max_y-3.
+   On the fixed-point values that is a plain range check per axis, which
+   is what the vector kernels compare against. */
+static inline int bullet_in_field(int x,int y){
+    return y>=FX(3) && y<FX(max_y-2) && x>=0 && x<FX(max_x);
+}
+
+void advance_bullets_scalar(){
+    int w=0;
+    for(int i=0;i<bullets.n;i++){
+        int x=bullets.x[i]+bullets.dx[i];
+        int y=bullets.y[i]+bullets.dy[i];
+        if(!bullet_in_field(x,y)){
+            drop_bullet(i);
+            continue;
+        }
+        bullets.x[w]=x; bullets.y[w]=y;
+        bullets.dx[w]=bullets.dx[i]; bullets.dy[w]=bullets.dy[i];
+        bullets.id[w]=bullets.id[i];
+        w++;
+    }
+    bullets.n=w;
+}
+
+/* Could bullet i hit something on its move from y to y+dy? Up-shots check
+   the swept cells along their path, down-shots the player sprite's
+   bounding box (player_hit() then tests its mask). */
+static inline int is_hit_candidate(int i){
+    int x=CELL(bullets.x[i]),y0=CELL(bullets.y[i]),y1=CELL(bullets.y[i]+bullets.dy[i]);
+    if(bullets.dy[i]<0){
+        for(int r=y1<0?0:y1;r<=y0;r++)
+            if(sweep_occ[r*max_x+x]) return 1;
+        return 0;
+    }
+    const Sprite *sp=&sprites[SPR_PLAYER];
+    int top=player.y-sp->ay,left=player.x-sp->ax;
+    return y0<top+sp->h && top<=y1 && left<=x && x<left+sp->w;
+}
+
+int hit_candidates_scalar(int *out){
+    int n=0;
+    for(int i=0;i<bullets.n;i++)
+        if(is_hit_candidate(i)) out[n++]=i;
+    return n;
+}
+
+/* Partially kept block: move survivors down to w one by one and release
+   the rest. Lane k's keep flag is bit k of the movemask. */
+static int compact_block(int i,int w,unsigned mask,const int *nx,const int *ny,int lanes){
+    for(int k=0;k<lanes;k++){
+        if(!((mask>>k)&1)){
+            drop_bullet(i+k);
+            continue;
+        }
+        bullets.x[w]=nx[k]; bullets.y[w]=ny[k];
+        bullets.dx[w]=bullets.dx[i+k]; bullets.dy[w]=bullets.dy[i+k];
+        bullets.id[w]=bullets.id[i+k];
+        w++;
+    }
+    return w;
+}
+
+/* Scalar tail shared by the vector kernels */
+static int advance_tail(int i,int w){
+    for(;i<bullets.n;i++){
+        int x=bullets.x[i]+bullets.dx[i];
+        int y=bullets.y[i]+bullets.dy[i];
+        if(!bullet_in_field(x,y)){
+            drop_bullet(i);
+            continue;
+        }
+        bullets.x[w]=x; bullets.y[w]=y;
+        bullets.dx[w]=bullets.dx[i]; bullets.dy[w]=bullets.dy[i];
+        bullets.id[w]=bullets.id[i];
+        w++;
+    }
+    return w;
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse4.1")))
+void advance_bullets_sse4(){
+    const __m128i ylo=_mm_set1_epi32(FX(3)-1),yhi=_mm_set1_epi32(FX(max_y-2));
+    const __m128i xlo=_mm_set1_epi32(-1),xhi=_mm_set1_epi32(FX(max_x));
+    int nx[4],ny[4];
+    int i=0,w=0;
+    for(;i+4<=bullets.n;i+=4){
+        __m128i x=_mm_add_epi32(_mm_loadu_si128((__m128i*)&bullets.x[i]),
+                                _mm_loadu_si128((__m128i*)&bullets.dx[i]));
+        __m128i y=_mm_add_epi32(_mm_loadu_si128((__m128i*)&bullets.y[i]),
+                                _mm_loadu_si128((__m128i*)&bullets.dy[i]));
+        __m128i keep=_mm_and_si128(
+            _mm_and_si128(_mm_cmpgt_epi32(y,ylo),_mm_cmpgt_epi32(yhi,y)),
+            _mm_and_si128(_mm_cmpgt_epi32(x,xlo),_mm_cmpgt_epi32(xhi,x)));
+        unsigned mask=_mm_movemask_ps(_mm_castsi128_ps(keep));
+        if(mask==0xf){
+            _mm_storeu_si128((__m128i*)&bullets.x[w],x);
+            _mm_storeu_si128((__m128i*)&bullets.y[w],y);
+            if(w!=i){
+                _mm_storeu_si128((__m128i*)&bullets.dx[w],_mm_loadu_si128((__m128i*)&bullets.dx[i]));
+                _mm_storeu_si128((__m128i*)&bullets.dy[w],_mm_loadu_si128((__m128i*)&bullets.dy[i]));
+                _mm_storeu_si128((__m128i*)&bullets.id[w],_mm_loadu_si128((__m128i*)&bullets.id[i]));
+            }
+            w+=4;
+            continue;
+        }
+        _mm_storeu_si128((__m128i*)nx,x);
+        _mm_storeu_si128((__m128i*)ny,y);
+        w=compact_block(i,w,mask,nx,ny,4);
+    }
+    bullets.n=advance_tail(i,w);
+}
+
+/* Vector paths handle moves of up to one row and flag faster shots
+   unconditionally for the exact scalar search. SSE has no gather, so the
+   two swept cells are scalar loads into a lane array. */
+__attribute__((target("sse4.1")))
+int hit_candidates_sse4(int *out){
+    const Sprite *sp=&sprites[SPR_PLAYER];
+    const int top=player.y-sp->ay,left=player.x-sp->ax;
+    const __m128i w=_mm_set1_epi32(max_x);
+    const __m128i ptop=_mm_set1_epi32(top),pbot=_mm_set1_epi32(top+sp->h-1);
+    const __m128i pl=_mm_set1_epi32(left-1),pr=_mm_set1_epi32(left+sp->w);
+    const __m128i minus1=_mm_set1_epi32(-1),step=_mm_set1_epi32(-FX_ONE);
+    int idx[4],occ[4],n=0,i=0;
+    for(;i+4<=bullets.n;i+=4){
+        __m128i fx=_mm_loadu_si128((__m128i*)&bullets.x[i]);
+        __m128i fy=_mm_loadu_si128((__m128i*)&bullets.y[i]);
+        __m128i dy=_mm_loadu_si128((__m128i*)&bullets.dy[i]);
+        __m128i x=_mm_srai_epi32(fx,FX_SHIFT);
+        __m128i y=_mm_srai_epi32(fy,FX_SHIFT);
+        __m128i y1=_mm_srai_epi32(_mm_add_epi32(fy,dy),FX_SHIFT);
+        __m128i up=_mm_cmplt_epi32(dy,_mm_setzero_si128());
+        __m128i fast=_mm_cmplt_epi32(dy,step);
+        __m128i onp=_mm_andnot_si128(up,_mm_and_si128(
+                      _mm_andnot_si128(_mm_cmpgt_epi32(y,pbot),_mm_andnot_si128(_mm_cmpgt_epi32(ptop,y1),minus1)),
+                      _mm_and_si128(_mm_cmpgt_epi32(x,pl),_mm_cmpgt_epi32(pr,x))));
+        _mm_storeu_si128((__m128i*)idx,_mm_add_epi32(_mm_mullo_epi32(y,w),x));
+        for(int k=0;k<4;k++)
+            occ[k]=-(sweep_occ[idx[k]]|sweep_occ[idx[k]-max_x]);
+        __m128i hit=_mm_or_si128(_mm_and_si128(_mm_loadu_si128((__m128i*)occ),up),
+                                 _mm_or_si128(fast,onp));
+        unsigned m=_mm_movemask_ps(_mm_castsi128_ps(hit));
+        while(m){
+            out[n++]=i+__builtin_ctz(m);
+            m&=m-1;
+        }
+    }
+    for(;i<bullets.n;i++)
+        if(is_hit_candidate(i)) out[n++]=i;
+    return n;
+}
+
+__attribute__((target("avx2")))
+void advance_bullets_avx2(){
+    const __m256i ylo=_mm256_set1_epi32(FX(3)-1),yhi=_mm256_set1_epi32(FX(max_y-2));
+    const __m256i xlo=_mm256_set1_epi32(-1),xhi=_mm256_set1_epi32(FX(max_x));
+    int nx[8],ny[8];
+    int i=0,w=0;
+    for(;i+8<=bullets.n;i+=8){
+        __m256i x=_mm256_add_epi32(_mm256_loadu_si256((__m256i*)&bullets.x[i]),
+                                   _mm256_loadu_si256((__m256i*)&bullets.dx[i]));
+        __m256i y=_mm256_add_epi32(_mm256_loadu_si256((__m256i*)&bullets.y[i]),
+                                   _mm256_loadu_si256((__m256i*)&bullets.dy[i]));
+        __m256i keep=_mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpgt_epi32(y,ylo),_mm256_cmpgt_epi32(yhi,y)),
+            _mm256_and_si256(_mm256_cmpgt_epi32(x,xlo),_mm256_cmpgt_epi32(xhi,x)));
+        unsigned mask=_mm256_movemask_ps(_mm256_castsi256_ps(keep));
+        if(mask==0xff){
+            _mm256_storeu_si256((__m256i*)&bullets.x[w],x);
+            _mm256_storeu_si256((__m256i*)&bullets.y[w],y);
+            if(w!=i){
+                _mm256_storeu_si256((__m256i*)&bullets.dx[w],_mm256_loadu_si256((__m256i*)&bullets.dx[i]));
+                _mm256_storeu_si256((__m256i*)&bullets.dy[w],_mm256_loadu_si256((__m256i*)&bullets.dy[i]));
+                _mm256_storeu_si256((__m256i*)&bullets.id[w],_mm256_loadu_si256((__m256i*)&bullets.id[i]));
+            }
+            w+=8;
+            continue;
+        }
+        _mm256_storeu_si256((__m256i*)nx,x);
+        _mm256_storeu_si256((__m256i*)ny,y);
+        w=compact_block(i,w,mask,nx,ny,8);
+    }
+    bullets.n=advance_tail(i,w);
+}
+
+/* Gathers the start cell and the one above it for eight moves at once
+   from the byte grid (4-byte loads, low byte kept); shots moving more
+   than a row are flagged for the exact scalar search. */
+__attribute__((target("avx2")))
+int hit_candidates_avx2(int *out){
+    const Sprite *sp=&sprites[SPR_PLAYER];
+    const int top=player.y-sp->ay,left=player.x-sp->ax;
+    const __m256i w=_mm256_set1_epi32(max_x);
+    const __m256i ptop=_mm256_set1_epi32(top),pbot=_mm256_set1_epi32(top+sp->h-1);
+    const __m256i pl=_mm256_set1_epi32(left-1),pr=_mm256_set1_epi32(left+sp->w);
+    const __m256i minus1=_mm256_set1_epi32(-1),lo=_mm256_set1_epi32(0xff);
+    const __m256i zero=_mm256_setzero_si256(),step=_mm256_set1_epi32(-FX_ONE);
+    int n=0,i=0;
+    for(;i+8<=bullets.n;i+=8){
+        __m256i fx=_mm256_loadu_si256((__m256i*)&bullets.x[i]);
+        __m256i fy=_mm256_loadu_si256((__m256i*)&bullets.y[i]);
+        __m256i dy=_mm256_loadu_si256((__m256i*)&bullets.dy[i]);
+        __m256i x=_mm256_srai_epi32(fx,FX_SHIFT);
+        __m256i y=_mm256_srai_epi32(fy,FX_SHIFT);
+        __m256i y1=_mm256_srai_epi32(_mm256_add_epi32(fy,dy),FX_SHIFT);
+        __m256i up=_mm256_cmpgt_epi32(zero,dy);
+        __m256i fast=_mm256_cmpgt_epi32(step,dy);
+        __m256i idx=_mm256_add_epi32(_mm256_mullo_epi32(y,w),x);
+        __m256i o=_mm256_or_si256(
+            _mm256_i32gather_epi32((const int*)sweep_occ,idx,1),
+            _mm256_i32gather_epi32((const int*)sweep_occ,_mm256_sub_epi32(idx,w),1));
+        __m256i occ=_mm256_and_si256(up,_mm256_cmpgt_epi32(_mm256_and_si256(o,lo),zero));
+        __m256i onp=_mm256_andnot_si256(up,_mm256_and_si256(
+                      _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpgt_epi32(y,pbot),_mm256_cmpgt_epi32(ptop,y1)),minus1),
+                      _mm256_and_si256(_mm256_cmpgt_epi32(x,pl),_mm256_cmpgt_epi32(pr,x))));
+        unsigned m=_mm256_movemask_ps(_mm256_castsi256_ps(
+                     _mm256_or_si256(_mm256_or_si256(occ,fast),onp)));
+        while(m){
+            out[n++]=i+__builtin_ctz(m);
+            m&=m-1;
+        }
+    }
+    for(;i<bullets.n;i++)
+        if(is_hit_candidate(i)) out[n++]=i;
+    return n;
+}
+#endif
+
+Kernels kernel_table[]={
+    { "scalar", advance_bullets_scalar, hit_candidates_scalar },
+#ifdef HAVE_X86_KERNELS
+    { "sse4.1", advance_bullets_sse4, hit_candidates_sse4 },
+    { "avx2", advance_bullets_avx2, hit_candidates_avx2 },
+#endif
+};
+
+int kernel_usable(const Kernels *k){
+#ifdef HAVE_X86_KERNELS
+    if(k->advance==advance_bullets_sse4) return __builtin_cpu_supports("sse4.1");
+    if(k->advance==advance_bullets_avx2) return __builtin_cpu_supports("avx2");
+#endif
+    (void)k;
+    return 1;
+}
+
+/* Best kernel set this CPU supports */
+Kernels *select_kernels(){
+    Kernels *best=&kernel_table[0];
+    for(size_t i=0;i<sizeof(kernel_table)/sizeof(kernel_table[0]);i++)
+        if(kernel_usable(&kernel_table[i])) best=&kernel_table[i];
+    return best;
+}
+
+/* Headless timing of every usable kernel set on a 200x60 field. Each rep
+   restores the same bullet population (and fresh handles for it), so all
+   kernels see identical work. Fails (exit 1) if the timed reps made any
+   heap calls. */
+int run_benchmarks(){
+    static const int sizes[]={ 10000, 100000, 1000000 };
+    max_x=HEADLESS_W; max_y=HEADLESS_H;
+    player.x=max_x/2; player.y=max_y-3;
+    alloc_grids();
+    arena_init(&tick_arena,TICK_ARENA_RESERVE);
+    sim_rng=1;
+    enemy_speed=25.0;
+    set_tick_rates();
+
+    unsigned long steady=0;
+    printf("%-8s %8s %12s %12s %9s\n","kernel","bullets","advance ns","hits ns","speedup");
+    for(size_t s=0;s<sizeof(sizes)/sizeof(sizes[0]);s++){
+        int n=sizes[s];
+        enemies.n=0; bullets.n=0;
+        reg_reset(&enemy_reg); reg_reset(&bullet_reg);
+        for(int i=0;i<n/2;i++){
+            int x=rng_range(&sim_rng,max_x-4)+2;
+            add_enemy(FX(x),FX(3+rng_range(&sim_rng,max_y-7)),enemy_vy,SPR_GRUNT);
+        }
+        for(int i=0;i<n;i++){
+            int x=FX(rng_range(&sim_rng,max_x))+rng_range(&sim_rng,FX_ONE);
+            int y=FX(3+rng_range(&sim_rng,max_y-6))+rng_range(&sim_rng,FX_ONE);
+            int dx=(rng_range(&sim_rng,3)-1)*shot_vy;
+            add_bullet(x,y,dx,rng_range(&sim_rng,2)?shot_vy:-shot_vy);
+        }
+        for(int i=0;i<enemies.n;i++) enemies.py[i]=enemies.y[i]-(i&1)*enemy_vy;
+        arena_reset(&tick_arena);
+        build_grid();
+        hit_cand=arena_alloc(&tick_arena,sizeof(int)*n);
+
+        size_t bytes=sizeof(int)*n;
+        int *sx=xmalloc(bytes),*sy=xmalloc(bytes),*sdx=xmalloc(bytes),*sdy=xmalloc(bytes);
+        memcpy(sx,bullets.x,bytes); memcpy(sy,bullets.y,bytes);
+        memcpy(sdx,bullets.dx,bytes); memcpy(sdy,bullets.dy,bytes);
+
+        int reps=n>=1000000?20:200;
+        double base=0;
+        for(size_t k=0;k<sizeof(kernel_table)/sizeof(kernel_table[0]);k++){
+            Kernels *kt=&kernel_table[k];
+            if(!kernel_usable(kt)) continue;
+            long long adv=0,hit=0;
+            unsigned long heap_mark=heap_calls;
+            for(int r=0;r<reps;r++){
+                memcpy(bullets.x,sx,bytes); memcpy(bullets.y,sy,bytes);
+                memcpy(bullets.dx,sdx,bytes); memcpy(bullets.dy,sdy,bytes);
+                reg_reset(&bullet_reg);
+                for(int i=0;i<n;i++) bullets.id[i]=reg_alloc(&bullet_reg,i);
+                bullets.n=n;
+                long long t0=now_ns();
+                kt->advance();
+                long long t1=now_ns();
+                kt->hits(hit_cand);
+                hit+=now_ns()-t1;
+                adv+=t1-t0;
+            }
+            steady+=heap_calls-heap_mark;
+            double total=(double)(adv+hit)/reps;
+            if(!base) base=total;
+            printf("%-8s %8d %12.0f %12.0f %8.2fx\n",kt->name,n,
+                   (double)adv/reps,(double)hit/reps,base/total);
+        }
+        xfree(sx); xfree(sy); xfree(sdx); xfree(sdy);
+    }
+    clear_lists();
+    printf("heap calls in timed reps: %lu\n",steady);
+    return steady?1:0;
+}
+
+/* -------- OUTPUT BUDGET -------- */
+/* Start metering from here, so the menu's output is not charged to the
+   first frame */
+void budget_init(){
+    int n=max_x*max_y;
+    out_mark_bytes=out_bytes;
+    out_mark_sgr=out_sgr_bytes;
+    bw_age=xcalloc(n,sizeof(unsigned short));
+    bw_cells=xmalloc(sizeof(int)*n);
+    bw_order=xmalloc(sizeof(int)*n);
+    bw_level=xmalloc(n);
+    bw_tokens=0;
+    bw_refill_at=now_ns();
+}
+
+void budget_release(){
+    xfree(bw_age); xfree(bw_cells); xfree(bw_order); xfree(bw_level);
+    bw_age=NULL;
+}
+
+/* Between drawing a frame and refresh(): compare stdscr with what curses
+   believes the terminal shows (curscr) and put back every changed cell
+   the bucket cannot afford this frame, so refresh() leaves it alone
+   (copied back as is: waddch() would blend in the background pair).
+   Changed cells are bucketed by priority (lower goes first); a cell that
+   was held back gains BW_AGE_BOOST per frame. Blank against blank in
+   another pair looks the same, so it is never sent. */
+void budget_frame(const Frame *f){
+    long long now=now_ns();
+    double burst=bw_budget*BW_BURST_MS/1000.0;
+    bw_tokens+=bw_budget*((now-bw_refill_at)/1e9);
+    if(bw_tokens>burst) bw_tokens=burst;
+    bw_refill_at=now;
+
+    char hud[48];
+    int hud_end=2+snprintf(hud,sizeof(hud),"Score:%d Lives:%d",f->player.score,f->player.lives);
+    int count[BW_LEVELS+1]={0},n=0;
+    for(int y=0;y<max_y;y++)
+        for(int x=0;x<max_x;x++){
+            int c=y*max_x+x;
+            chtype want=mvwinch(stdscr,y,x),have=mvwinch(curscr,y,x);
+            if(want==have || ((want&A_CHARTEXT)==' ' && (have&A_CHARTEXT)==' ')){
+                if(want!=have) mvwaddchnstr(stdscr,y,x,&have,1);
+                bw_age[c]=0;
+                continue;
+            }
+            int level;
+            if(y==0 && x>=2 && x<hud_end) level=0;
+            else if(y>=2 && y<max_y-2){
+                int dx=abs(x-f->player.x),dy=2*abs(y-f->player.y);
+                level=1+(dx>dy?dx:dy);
+                if(level>BW_LEVELS-2) level=BW_LEVELS-2;
+            }
+            else level=BW_LEVELS-1;
+            level-=bw_age[c]*BW_AGE_BOOST;
+            if(level<1 && !(y==0 && x>=2 && x<hud_end)) level=1;
+            if(level<0) level=0;
+            bw_level[n]=level;
+            bw_cells[n++]=c;
+            count[level+1]++;
+        }
+    for(int l=0;l<BW_LEVELS;l++) count[l+1]+=count[l];
+    for(int k=0;k<n;k++) bw_order[count[bw_level[k]]++]=bw_cells[k];
+
+    int afford=bw_tokens>0?(int)(bw_tokens/bw_cell_cost):0;
+    bw_sent=n<afford?n:afford;
+    bw_held=n-bw_sent;
+    bw_age_max=0;
+    for(int k=0;k<n;k++){
+        int c=bw_order[k];
+        if(k<bw_sent){
+            bw_age[c]=0;
+            continue;
+        }
+        int y=c/max_x,x=c%max_x;
+        chtype have=mvwinch(curscr,y,x);
+        mvwaddchnstr(stdscr,y,x,&have,1);
+        if(bw_age[c]<65535) bw_age[c]++;
+        if(bw_age[c]>bw_age_max) bw_age_max=bw_age[c];
+    }
+    bw_frames++;
+    bw_held_total+=bw_held;
+    if((unsigned long)bw_age_max>bw_stale_max) bw_stale_max=bw_age_max;
+}
+
+/* -------- OUTPUT TAP -------- */
+/* Deliberate interposition: defining write() here replaces the libc symbol
+   for the whole process, stdio and zlib included, since curses has no hook
+   of its own for what it sends. Only stdout while curses owns it (from
+   initscr() through the last endwin()) is accounted, compressed and
+   recorded; everything else passes straight to the system call. */
+ssize_t write(int fd, const void *buf, size_t n){
+    if(fd==STDOUT_FILENO && out_tap){
+        count_output(buf,n);
+        if(zsess) zs_feed(zsess,buf,n,Z_NO_FLUSH);
+        if(rec) rec_push(rec,buf,n);
+    }
+    return syscall(SYS_write,fd,buf,n);
+}
+
+/* deflate's state goes through the heap accounting like everything else */
+static voidpf zs_alloc(voidpf opaque, uInt n, uInt size){
+    (void)opaque;
+    return heap_calloc(n,size,"deflate");
+}
+
+static void zs_free(voidpf opaque, voidpf p){
+    (void)opaque;
+    heap_free(p,"deflate");
+}
+
+ZSession *zs_open(const char *path){
+    ZSession *z=xcalloc(1,sizeof(ZSession));
+    z->fd=open(path,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if(z->fd<0){
+        perror(path);
+        xfree(z);
+        return NULL;
+    }
+    z->zs.zalloc=zs_alloc;
+    z->zs.zfree=zs_free;
+    if(deflateInit2(&z->zs,Z_DEFAULT_COMPRESSION,Z_DEFLATED,ZS_WBITS,ZS_MEMLEVEL,
+                    Z_DEFAULT_STRATEGY)!=Z_OK){
+        fprintf(stderr,"deflateInit2 failed\n");
+        close(z->fd);
+        xfree(z);
+        return NULL;
+    }
+    return z;
+}
+
+/* Compress n bytes; Z_SYNC_FLUSH ends a frame, Z_FINISH the stream.
+   Output goes out in whole chunks as it fills. */
+void zs_feed(ZSession *z, const void *buf, size_t n, int flush){
+    long long t0=thread_cpu_ns();
+    z->zs.next_in=(Bytef*)buf;
+    z->zs.avail_in=n;
+    z->raw+=n;
+    do {
+        z->zs.next_out=z->out;
+        z->zs.avail_out=ZS_CHUNK;
+        deflate(&z->zs,flush);
+        size_t have=ZS_CHUNK-z->zs.avail_out;
+        if(have && syscall(SYS_write,z->fd,z->out,have)<0) break;
+        z->packed+=have;
+    } while(z->zs.avail_out==0);
+    if(flush==Z_SYNC_FLUSH) z->frames++;
+    z->cpu_ns+=thread_cpu_ns()-t0;
+}
+
+void zs_close(ZSession *z){
+    zs_feed(z,NULL,0,Z_FINISH);
+    deflateEnd(&z->zs);
+    close(z->fd);
+    xfree(z);
+}
+
+long long thread_cpu_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts);
+    return ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+/* -------- RECORDER -------- */
+Recorder *rec_start(const char *path){
+    Recorder *r=xcalloc(1,sizeof(Recorder));
+    r->path=path;
+    r->ring=xmalloc(REC_RING_SIZE);
+    r->batch=xmalloc(REC_BATCH);
+    r->t0=now_ns();
+    if(rec_open(r)<0){
+        xfree(r->ring); xfree(r->batch); xfree(r);
+        return NULL;
+    }
+    atomic_store(&r->running,1);
+    pthread_create(&r->tid,NULL,rec_main,r);
+    return r;
+}
+
+/* The writer drains what is left before it exits */
+void rec_stop(Recorder *r){
+    atomic_store(&r->running,0);
+    pthread_join(r->tid,NULL);
+    close(r->fd);
+    printf("Recording: %lu events, %llu bytes in %d file%s, %lu dropped, ring peak %zu KB\n",
+           r->events,r->written,r->files,r->files==1?"":"s",r->dropped,r->fill_max>>10);
+    xfree(r->ring); xfree(r->batch); xfree(r);
+}
+
+static void ring_copy_in(Recorder *r, size_t at, const void *src, size_t n){
+    size_t off=at&(REC_RING_SIZE-1),first=REC_RING_SIZE-off;
+    if(first>n) first=n;
+    memcpy(r->ring+off,src,first);
+    memcpy(r->ring,(const char*)src+first,n-first);
+}
+
+static void ring_copy_out(Recorder *r, size_t at, void *dst, size_t n){
+    size_t off=at&(REC_RING_SIZE-1),first=REC_RING_SIZE-off;
+    if(first>n) first=n;
+    memcpy(dst,r->ring+off,first);
+    memcpy((char*)dst+first,r->ring,n-first);
+}
+
+/* Producer side, called from the write() tap */
+void rec_push(Recorder *r, const void *buf, size_t n){
+    size_t head=atomic_load_explicit(&r->head,memory_order_relaxed);
+    size_t used=head-atomic_load_explicit(&r->tail,memory_order_acquire);
+    if(used+sizeof(RecHeader)+n>REC_RING_SIZE){
+        r->dropped++;
+        return;
+    }
+    RecHeader h={ now_ns()-r->t0, (uint32_t)n, 0 };
+    ring_copy_in(r,head,&h,sizeof(h));
+    ring_copy_in(r,head+sizeof(h),buf,n);
+    if(used+sizeof(h)+n>r->fill_max) r->fill_max=used+sizeof(h)+n;
+    atomic_store_explicit(&r->head,head+sizeof(h)+n,memory_order_release);
+}
+
+/* A fresh file (after rotating the old ones) with its own header */
+int rec_open(Recorder *r){
+    if(r->files){
+        char from[4096],to[4096];
+        for(int k=REC_KEEP;k>1;k--){
+            snprintf(from,sizeof(from),"%s.%d",r->path,k-1);
+            snprintf(to,sizeof(to),"%s.%d",r->path,k);
+            rename(from,to);
+        }
+        snprintf(to,sizeof(to),"%s.1",r->path);
+        close(r->fd);
+        rename(r->path,to);
+    }
+    r->fd=open(r->path,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if(r->fd<0){
+        perror(r->path);
+        return -1;
+    }
+    char hdr[256];
+    const char *term=getenv("TERM");
+    int n=snprintf(hdr,sizeof(hdr),
+                   "{\"version\": 2, \"width\": %d, \"height\": %d, \"timestamp\": %ld, "
+                   "\"env\": {\"TERM\": \"%s\"}}\n",
+                   max_x,max_y,(long)time(NULL),term?term:"xterm");
+    if(write(r->fd,hdr,n)<0) return -1;
+    r->file_bytes=n;
+    r->written+=n;
+    r->files++;
+    return 0;
+}
+
+void rec_flush(Recorder *r){
+    if(!r->batch_n) return;
+    if(r->fd>=0 && write(r->fd,r->batch,r->batch_n)>0){
+        r->file_bytes+=r->batch_n;
+        r->written+=r->batch_n;
+    }
+    r->batch_n=0;
+}
+
+/* Consumer: one [time, "o", data] line per record. Control characters
+   and the JSON specials are escaped; everything else passes through.
+   Files rotate between records, so no line is split. */
+void *rec_main(void *arg){
+    Recorder *r=arg;
+    unsigned char data[4096];
+    for(;;){
+        int live=atomic_load(&r->running);
+        size_t tail=atomic_load_explicit(&r->tail,memory_order_relaxed);
+        size_t head=atomic_load_explicit(&r->head,memory_order_acquire);
+        if(tail==head){
+            rec_flush(r);
+            if(!live) break;
+            usleep(REC_IDLE_US);
+            continue;
+        }
+        if(r->file_bytes+(long)r->batch_n>REC_MAX_BYTES){
+            rec_flush(r);
+            rec_open(r);
+        }
+        RecHeader h;
+        ring_copy_out(r,tail,&h,sizeof(h));
+        size_t at=tail+sizeof(h);
+        char *b=r->batch;
+        if(r->batch_n+64>REC_BATCH) rec_flush(r);
+        r->batch_n+=snprintf(b+r->batch_n,64,"[%.6f, \"o\", \"",h.t_ns/1e9);
+        for(size_t done=0;done<h.len;){
+            size_t k=h.len-done<sizeof(data)?h.len-done:sizeof(data);
+            ring_copy_out(r,at+done,data,k);
+            for(size_t i=0;i<k;i++){
+                if(r->batch_n+8>REC_BATCH) rec_flush(r);
+                unsigned char c=data[i];
+                if(c=='"'||c=='\\'){ b[r->batch_n++]='\\'; b[r->batch_n++]=c; }
+                else if(c<0x20||c==0x7f) r->batch_n+=snprintf(b+r->batch_n,8,"\\u%04x",c);
+                else b[r->batch_n++]=c;
+            }
+            done+=k;
+        }
+        if(r->batch_n+4>REC_BATCH) rec_flush(r);
+        memcpy(b+r->batch_n,"\"]\n",3);
+        r->batch_n+=3;
+        r->events++;
+        atomic_store_explicit(&r->tail,at+h.len,memory_order_release);
+    }
+    return NULL;
+}
+
+/* -------- HIGH SCORES -------- */
+/* Map the score file, creating or growing it as needed; NULL if it
+   cannot be used */
+ScoreFile *scores_open(const char *path,int *fd){
+    *fd=open(path,O_RDWR|O_CREAT,0644);
+    if(*fd<0) return NULL;
+    struct stat st;
+    if(fstat(*fd,&st)<0 || (st.st_size<(off_t)sizeof(ScoreFile) && ftruncate(*fd,sizeof(ScoreFile))<0)){
+        close(*fd);
+        return NULL;
+    }
+    ScoreFile *sf=mmap(NULL,sizeof(ScoreFile),PROT_READ|PROT_WRITE,MAP_SHARED,*fd,0);
+    if(sf==MAP_FAILED){
+        close(*fd);
+        return NULL;
+    }
+    unsigned zero=0;
+    if(!atomic_compare_exchange_strong(&sf->magic,&zero,SCORE_MAGIC) && zero!=SCORE_MAGIC){
+        scores_close(sf,*fd);
+        return NULL;
+    }
+    return sf;
+}
+
+void scores_close(ScoreFile *sf,int fd){
+    munmap(sf,sizeof(ScoreFile));
+    close(fd);
+}
+
+/* Consistent copy of a table without taking its lock */
+void score_read(ScoreTable *t,ScoreTable *out){
+    unsigned s0,s1;
+    do {
+        while((s0=atomic_load_explicit(&t->seq,memory_order_acquire))&1) sched_yield();
+        out->n=t->n;
+        memcpy(out->top,t->top,sizeof(out->top));
+        atomic_thread_fence(memory_order_acquire);
+        s1=atomic_load_explicit(&t->seq,memory_order_relaxed);
+    } while(s0!=s1);
+    if(out->n<0 || out->n>SCORE_TOP) out->n=0;
+}
+
+/* Insert score in the table for game and level; returns its rank from 0,
+   or -1 if it did not place. Equal scores keep their older entry first. */
+int score_submit(ScoreFile *sf,int fd,int game,int level,int score){
+    ScoreTable *t=&sf->tables[game][level],snap;
+    score_read(t,&snap);
+    if(snap.n==SCORE_TOP && score<=snap.top[SCORE_TOP-1].score) return -1;
+
+    struct flock lk={ .l_type=F_WRLCK, .l_whence=SEEK_SET,
+                      .l_start=(char *)t-(char *)sf, .l_len=sizeof(ScoreTable) };
+    if(fcntl(fd,F_SETLKW,&lk)<0) return -1;
+    /* A writer that died mid-insert left seq odd; we hold the lock, so
+       nobody else is writing and the count can be trusted again */
+    unsigned seq=atomic_load_explicit(&t->seq,memory_order_relaxed)|1;
+    atomic_store_explicit(&t->seq,seq,memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    int n=t->n<0 || t->n>SCORE_TOP ? 0 : t->n;
+    int pos=0;
+    while(pos<n && t->top[pos].score>=score) pos++;
+    if(pos<SCORE_TOP){
+        int keep=n<SCORE_TOP ? n : SCORE_TOP-1;
+        memmove(&t->top[pos+1],&t->top[pos],sizeof(ScoreEntry)*(keep-pos));
+        ScoreEntry *e=&t->top[pos];
+        const char *who=getenv("USER");
+        memset(e,0,sizeof(*e));
+        e->score=score;
+        e->when=time(NULL);
+        snprintf(e->name,sizeof(e->name),"%s",who?who:"?");
+        t->n=keep+1;
+    } else pos=-1;
+    atomic_store_explicit(&t->seq,seq+1,memory_order_release);
+    lk.l_type=F_UNLCK;
+    fcntl(fd,F_SETLK,&lk);
+    return pos;
+}
+
+/* Submit a finished game's score and print the table it went into;
+   called after endwin() */
+void record_score(int game,int level,int score){
+    static const char *const names[SCORE_LEVELS]={ "Easy", "Medium", "Hard" };
+    char def[512];
+    const char *path=score_path;
+    if(level<1 || level>SCORE_LEVELS) return;
+    if(!path){
+        const char *home=getenv("HOME");
+        if(!home) return;
+        snprintf(def,sizeof(def),"%s/.tty-games-scores",home);
+        path=def;
+    }
+    int fd;
+    ScoreFile *sf=scores_open(path,&fd);
+    if(!sf){
+        perror(path);
+        return;
+    }
+    int rank=score>0 ? score_submit(sf,fd,game,level-1,score) : -1;
+    ScoreTable t;
+    score_read(&sf->tables[game][level-1],&t);
+    scores_close(sf,fd);
+    printf("High scores (%s):\n",names[level-1]);
+    for(int i=0;i<t.n;i++){
+        char day[16];
+        time_t when=t.top[i].when;
+        strftime(day,sizeof(day),"%Y-%m-%d",localtime(&when));
+        printf("  %2d. %8d  %-16.24s %s%s\n",i+1,t.top[i].score,t.top[i].name,day,i==rank?"  <-":"");
+    }
+}
+
+/* -------- REPLAYS -------- */
+uint64_t chain_fold(uint64_t chain,uint64_t h){
+    uint64_t s=chain^h;
+    return rng_next(&s);
+}
+
+int replay_begin(const char *path,int level){
+    replay_out=fopen(path,"wb");
+    if(!replay_out){
+        perror(path);
+        return -1;
+    }
+    replay_hdr=(ReplayHeader){ REPLAY_MAGIC, REPLAY_VERSION, sim_seed, SCORE_GAME_SHOOTER,
+                               level, 0, 0, max_x, max_y, 0, 0 };
+    replay_chain=sim_seed;
+    fwrite(&replay_hdr,sizeof(replay_hdr),1,replay_out);
+    return 0;
+}
+
+void replay_key(int ch){
+    ReplayRec r={ sim_tick, ch, 0 };
+    fwrite(&r,sizeof(r),1,replay_out);
+    replay_recs++;
+}
+
+/* After each step: fold the state into the chain, write it out now and then */
+void replay_tick(){
+    replay_chain=chain_fold(replay_chain,state_hash());
+    if(sim_tick%REPLAY_HASH_EVERY) return;
+    ReplayRec r={ sim_tick, REPLAY_HASH, replay_chain };
+    fwrite(&r,sizeof(r),1,replay_out);
+    replay_recs++;
+}
+
+void replay_end(){
+    replay_hdr.ticks=sim_tick;
+    replay_hdr.score=player.score;
+    fseek(replay_out,0,SEEK_SET);
+    fwrite(&replay_hdr,sizeof(replay_hdr),1,replay_out);
+    fclose(replay_out);
+    replay_out=NULL;
+}
+
+/* Re-simulate one replay with the game's own tick, stopping at the first
+   chain value that does not match */
+void verify_replay(const char *path,VerifyResult *r){
+    ReplayHeader h;
+    ReplayRec rec;
+    FILE *f=fopen(path,"rb");
+    *r=(VerifyResult){ 2, 0, 0, 0, "" };
+    if(!f || fread(&h,sizeof(h),1,f)!=1){
+        snprintf(r->why,sizeof(r->why),"cannot read");
+        if(f) fclose(f);
+        return;
+    }
+    if(h.magic!=REPLAY_MAGIC || h.version!=REPLAY_VERSION || h.game!=SCORE_GAME_SHOOTER ||
+       h.level<1 || h.level>4 || h.w<8 || h.h<8 || h.w>4096 || h.h>4096 || h.ticks<0){
+        snprintf(r->why,sizeof(r->why),"not a shooter replay");
+        fclose(f);
+        return;
+    }
+    max_x=h.w; max_y=h.h;
+    sim_seed=sim_rng=h.seed;
+    fx_rng=sim_seed^0x5bd1e995ULL;
+    sim_tick=0;
+    game_over=0;
+    stress=0;
+    memset(&particles,0,sizeof(particles));
+    set_level(h.level);
+    init_game();
+
+    uint64_t chain=h.seed;
+    int have=fread(&rec,sizeof(rec),1,f)==1;
+    r->status=1;
+    for(int t=0;;t++){
+        for(;have && rec.tick<=(uint32_t)t;have=fread(&rec,sizeof(rec),1,f)==1){
+            if(rec.tick<(uint32_t)t){
+                snprintf(r->why,sizeof(r->why),"records out of order");
+                goto done;
+            }
+            if(rec.key==REPLAY_HASH){
+                if(rec.hash!=chain){
+                    snprintf(r->why,sizeof(r->why),"state diverged");
+                    goto done;
+                }
+            }
+            else if(rec.key==KEY_LEFT||rec.key==KEY_RIGHT||rec.key==' ') apply_key(rec.key);
+            else {
+                snprintf(r->why,sizeof(r->why),"bad key %d",rec.key);
+                goto done;
+            }
+        }
+        if(t==h.ticks) break;
+        if(game_over){
+            snprintf(r->why,sizeof(r->why),"game over before the last tick");
+            goto done;
+        }
+        sim_step();
+        chain=chain_fold(chain,state_hash());
+        r->tick=t+1;
+    }
+    if(have) snprintf(r->why,sizeof(r->why),"records past the last tick");
+    else if(player.score!=h.score)
+        snprintf(r->why,sizeof(r->why),"claims %d, scored %d",h.score,player.score);
+    else r->status=0;
+done:
+    r->score=player.score;
+    r->ticks=sim_tick;
+    clear_lists();
+    fclose(f);
+}
+
+/* Verify replays on one worker process per core; each claims the next
+   replay from a shared counter. Exit status 1 if any was not accepted. */
+int verify_replays(int n,char **paths){
+    int workers=sysconf(_SC_NPROCESSORS_ONLN);
+    if(workers>n) workers=n;
+    if(workers<1) workers=1;
+    size_t size=sizeof(atomic_int)+sizeof(VerifyResult)*n;
+    size=(size+15)&~(size_t)15;
+    char *shared=mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+    if(shared==MAP_FAILED){
+        perror("mmap");
+        return 1;
+    }
+    atomic_int *next=(atomic_int *)shared;
+    VerifyResult *res=(VerifyResult *)(shared+16);
+    atomic_store(next,0);
+    for(int i=0;i<n;i++) res[i]=(VerifyResult){ 2, 0, 0, 0, "not run" };
+
+    sim_threads=1;
+    fflush(stdout);
+    long long t0=now_ns();
+    for(int w=0;w<workers;w++){
+        pid_t pid=fork();
+        if(pid<0){
+            perror("fork");
+            break;
+        }
+        if(pid) continue;
+        for(int i;(i=atomic_fetch_add(next,1))<n;) verify_replay(paths[i],&res[i]);
+        _exit(0);
+    }
+    while(wait(NULL)>0);
+    double wall=(now_ns()-t0)/1e9;
+
+    long ticks=0;
+    int bad=0;
+    for(int i=0;i<n;i++){
+        ticks+=res[i].ticks;
+        if(res[i].status==0)
+            printf("%s: ok, score %d in %ld ticks\n",paths[i],res[i].score,res[i].ticks);
+        else {
+            bad++;
+            if(res[i].status==1)
+                printf("%s: rejected at tick %d: %s\n",paths[i],res[i].tick,res[i].why);
+            else printf("%s: %s\n",paths[i],res[i].why);
+        }
+    }
+    printf("Verified %d replays, %d not accepted, %ld ticks in %.2f s (%.0f ticks/s) on %d processes\n",
+           n,bad,ticks,wall,wall>0?ticks/wall:0.0,workers);
+    munmap(shared,size);
+    return bad?1:0;
+}
+
+/* -------- REWIND -------- */
+void rewind_start(){
+    rw_ring=xmalloc(REWIND_BYTES);
+    rewind_on=1;
+}
+
+void rewind_release(){
+    xfree(rw_ring);
+    rw_ring=NULL;
+    rewind_on=0;
+}
+
+/* Make room for n more bytes, oldest keyframe first; 0 once there is no
+   keyframe left to hang them on */
+int rw_reserve(size_t n){
+    while(rw_head+n-rw_tail>REWIND_BYTES && kf_head!=kf_tail){
+        kf_tail++;
+        rw_tail=kf_head!=kf_tail?rw_kf[kf_tail&(REWIND_KEYFRAMES-1)].off:rw_head;
+    }
+    return kf_head!=kf_tail;
+}
+
+/* Copy between p and the ring at running offset at, either way round, or
+   between p and the snapshot file, hashing what passes */
+void rw_copy(size_t at,void *p,size_t n,int mode){
+    if(mode==RW_WRITE || mode==RW_READ){
+        if(snap_err) return;
+        ssize_t k=mode==RW_WRITE?write(snap_fd,p,n):read(snap_fd,p,n);
+        if(k!=(ssize_t)n) snap_err=1;
+        snap_sum=fnv(snap_sum,p,n);
+        return;
+    }
+    size_t o=at%REWIND_BYTES,first=n<REWIND_BYTES-o?n:REWIND_BYTES-o;
+    if(mode==RW_SAVE){
+        memcpy(rw_ring+o,p,first);
+        memcpy(rw_ring,(char*)p+first,n-first);
+    }
+    else if(mode==RW_LOAD){
+        memcpy(p,rw_ring+o,first);
+        memcpy((char*)p+first,rw_ring,n-first);
+    }
+}
+
+/* One walk over the simulation state, as of the start of a tick, that
+   sizes, saves or restores a keyframe at at, or writes or reads a
+   snapshot; returns where it ends. Pool and registry capacities only grow
+   during a game, so a keyframe restore always fits. What is read from a
+   file is checked against the invariants a tick boundary holds: counts
+   within capacities, every index within what it indexes, entities on the
+   field and timer lists free of cycles. Script resume points need no
+   check, as an unknown one just ends the script. Particles are left
+   alone: they are not simulation state. */
+size_t walk_state(size_t at,int mode){
+#define RW(p,len) do{ rw_copy(at,(p),(len),mode); at+=(len); }while(0)
+#define RW_CHECK(ok) do{ if(mode==RW_READ && !(ok)) snap_err=1; }while(0)
+    unsigned long tick=sim_tick;
+    RW(&tick,sizeof(tick));
+    RW(&sim_rng,sizeof(sim_rng));
+    RW(&player,sizeof(player));
+    RW_CHECK(sprite_fits(SPR_PLAYER,player.x,player.y));
+    RW(&zhash,sizeof(zhash));
+    RW(&zh_enemy_pass,sizeof(unsigned));
+    RW(&zh_bullet_pass,sizeof(unsigned));
+    RW(&wave,sizeof(wave));
+
+    RW(&enemies.n,sizeof(int));
+    RW_CHECK(enemies.n>=0 && enemies.n<=enemies.cap);
+    RW(enemies.x,sizeof(int)*enemies.n);
+    RW(enemies.y,sizeof(int)*enemies.n);
+    RW(enemies.py,sizeof(int)*enemies.n);
+    RW(enemies.vy,sizeof(int)*enemies.n);
+    RW(enemies.kind,enemies.n);
+    RW(enemies.script,enemies.n);
+    RW(enemies.pc,sizeof(unsigned short)*enemies.n);
+    RW(enemies.ctr,enemies.n);
+    RW(enemies.id,sizeof(Handle)*enemies.n);
+    if(mode==RW_READ)
+        for(int i=0;i<enemies.n && !snap_err;i++)
+            RW_CHECK(enemies.kind[i]>=SPR_GRUNT && enemies.kind[i]<NUM_SPRITES
+                     && enemies.script[i]<NUM_SCRIPTS
+                     && enemies.vy[i]>=0 && enemies.vy[i]<FX(max_y)
+                     && enemies.y[i]>=0 && CELL(enemies.y[i])<max_y-3
+                     && sprite_fits(enemies.kind[i],CELL(enemies.x[i]),CELL(enemies.y[i])));
+    RW(&bullets.n,sizeof(int));
+    RW_CHECK(bullets.n>=0 && bullets.n<=bullets.cap);
+    RW(bullets.x,sizeof(int)*bullets.n);
+    RW(bullets.y,sizeof(int)*bullets.n);
+    RW(bullets.dx,sizeof(int)*bullets.n);
+    RW(bullets.dy,sizeof(int)*bullets.n);
+    RW(bullets.id,sizeof(Handle)*bullets.n);
+    if(mode==RW_READ)
+        for(int i=0;i<bullets.n && !snap_err;i++)
+            RW_CHECK(bullet_in_field(bullets.x[i],bullets.y[i])
+                     && bullets.dx[i]>-FX(max_x) && bullets.dx[i]<FX(max_x)
+                     && bullets.dy[i]>-FX(max_y) && bullets.dy[i]<FX(max_y));
+
+    Registry *regs[2]={ &enemy_reg, &bullet_reg };
+    int pool_n[2]={ enemies.n, bullets.n };
+    for(int k=0;k<2;k++){
+        Registry *r=regs[k];
+        RW(&r->n_slots,sizeof(int));
+        RW_CHECK(r->n_slots>=0 && r->n_slots<=r->cap);
+        RW(r->slots,sizeof(RegSlot)*r->n_slots);
+        if(mode==RW_READ)
+            for(int i=0;i<r->n_slots && !snap_err;i++)
+                RW_CHECK(r->slots[i].dense>=-1 && r->slots[i].dense<pool_n[k]);
+        RW(&r->free_head,sizeof(unsigned));
+        RW(&r->free_tail,sizeof(unsigned));
+        RW_CHECK(r->free_tail-r->free_head<=(unsigned)r->cap);
+        for(unsigned q=r->free_head;q!=r->free_tail && !snap_err;q++){
+            RW(&r->free_q[q&(r->cap-1)],sizeof(int));
+            RW_CHECK(r->free_q[q&(r->cap-1)]>=0 && r->free_q[q&(r->cap-1)]<r->n_slots);
+        }
+    }
+    if(mode==RW_READ){
+        for(int i=0;i<enemies.n && !snap_err;i++)
+            RW_CHECK(HANDLE_SLOT(enemies.id[i])<enemy_reg.n_slots);
+        for(int i=0;i<bullets.n && !snap_err;i++)
+            RW_CHECK(HANDLE_SLOT(bullets.id[i])<bullet_reg.n_slots);
+    }
+
+    RW(wheel.head,sizeof(wheel.head));
+    RW(&wheel.n,sizeof(int));
+    RW_CHECK(wheel.n>=0 && wheel.n<=wheel.cap);
+    RW(&wheel.free,sizeof(int));
+    RW(wheel.t,sizeof(Timer)*wheel.n);
+    RW_CHECK(!snap_err && timers_valid());
+    if(mode==RW_LOAD || mode==RW_READ) sim_tick=tick;
+#undef RW_CHECK
+#undef RW
+    return at;
+}
+
+/* At the top of each tick: a keyframe when one is due */
+void rewind_mark(){
+    Keyframe *last=&rw_kf[(kf_head-1)&(REWIND_KEYFRAMES-1)];
+    if(sim_tick%REWIND_KEYFRAME_TICKS || (kf_head!=kf_tail && last->tick==sim_tick)) return;
+    size_t n=walk_state(0,RW_MEASURE);
+    if(n>REWIND_BYTES) return;
+    if(kf_head-kf_tail==REWIND_KEYFRAMES){
+        kf_tail++;
+        rw_tail=rw_kf[kf_tail&(REWIND_KEYFRAMES-1)].off;
+    }
+    rw_reserve(n);
+    rw_kf[kf_head++&(REWIND_KEYFRAMES-1)]=(Keyframe){ sim_tick, rw_head };
+    rw_head=walk_state(rw_head,RW_SAVE);
+}
+
+void rewind_key(int ch){
+    RewindRec r={ sim_tick, ch };
+    if(!rw_reserve(sizeof(r))) return;
+    rw_copy(rw_head,&r,sizeof(r),RW_SAVE);
+    rw_head+=sizeof(r);
+}
+
+/* Go back n ticks, or as far as the oldest keyframe allows */
+void rewind_step(int n){
+    if(kf_head==kf_tail) return;
+    long long t0=now_ns();
+    unsigned long oldest=rw_kf[kf_tail&(REWIND_KEYFRAMES-1)].tick;
+    unsigned long from=sim_tick,target=from>oldest+n?from-n:oldest;
+    if(target==from) return;
+
+    while(rw_kf[(kf_head-1)&(REWIND_KEYFRAMES-1)].tick>target) kf_head--;
+    size_t at=walk_state(rw_kf[(kf_head-1)&(REWIND_KEYFRAMES-1)].off,RW_LOAD);
+    particles.tail=particles.head;
+    rewind_resim+=target-sim_tick;
+    for(RewindRec r;at<rw_head;at+=sizeof(r)){
+        rw_copy(at,&r,sizeof(r),RW_LOAD);
+        if(r.tick>=target) break;
+        while(sim_tick<r.tick) sim_step();
+        apply_key(r.key);
+    }
+    while(sim_tick<target) sim_step();
+    rw_head=at;
+
+    ticks_rewound+=from-target;
+    rewind_steps++;
+    rewind_ns+=now_ns()-t0;
+}
+
+/* -------- SNAPSHOTS -------- */
+uint64_t fnv(uint64_t h, const void *p, size_t n){
+    for(size_t i=0;i<n;i++){
+        h^=((const unsigned char*)p)[i];
+        h*=0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Capacities are checked before anything is sized by them: nonzero,
+   within SNAP_CAP_MAX, and registry ones powers of two for the free
+   queue's mask. walk_state() checks the stored counts against them. */
+int snap_caps_ok(const SnapHeader *h){
+    for(int k=0;k<5;k++)
+        if(h->caps[k]<1 || h->caps[k]>SNAP_CAP_MAX) return 0;
+    for(int k=2;k<4;k++)
+        if(h->caps[k]&(h->caps[k]-1)) return 0;
+    return 1;
+}
+
+/* Does a sprite anchored at cell (x, y) lie wholly on the field? */
+int sprite_fits(int kind,int x,int y){
+    const Sprite *sp=&sprites[kind];
+    return x-sp->ax>=0 && x-sp->ax+sp->w<=max_x && y-sp->ay>=0 && y-sp->ay+sp->h<=max_y;
+}
+
+/* Every wheel list and the free list link only nodes below wheel.n, each
+   node is on one list at most (so no walk can loop), and timer handles
+   are within the enemy registry */
+int timers_valid(){
+    int seen=0;
+    for(int k=0;k<=WHEEL_SLOTS;k++)
+        for(int j=k<WHEEL_SLOTS?wheel.head[k]:wheel.free;j!=-1;j=wheel.t[j].next){
+            if(j<0 || j>=wheel.n || ++seen>wheel.n) return 0;
+            Handle h=wheel.t[j].h;
+            if(h!=HANDLE_NONE && HANDLE_SLOT(h)>=enemy_reg.n_slots) return 0;
+        }
+    return 1;
+}
+
+/* Runs in the forked child: only system calls, no heap and no stdio */
+int snapshot_write(const char *path){
+    char tmp[PATH_MAX];
+    if(snprintf(tmp,sizeof(tmp),"%s.tmp",path)>=(int)sizeof(tmp)) return -1;
+    snap_fd=open(tmp,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if(snap_fd<0) return -1;
+    SnapHeader h={ SNAP_MAGIC, SNAP_VERSION, sim_seed, SCORE_GAME_SHOOTER, snap_level, max_x, max_y,
+                   { SNAP_CAP(enemies.cap), SNAP_CAP(bullets.cap), SNAP_CAP(enemy_reg.cap),
+                     SNAP_CAP(bullet_reg.cap), SNAP_CAP(wheel.cap) }, 0, 0 };
+    snap_err=write(snap_fd,&h,sizeof(h))!=sizeof(h);
+    snap_sum=0xcbf29ce484222325ULL;
+    h.size=walk_state(0,RW_WRITE);
+    h.check=fnv(snap_sum,&h,sizeof(h));
+    if(!snap_err) snap_err=pwrite(snap_fd,&h,sizeof(h),0)!=sizeof(h);
+    if(!snap_err) snap_err=fsync(snap_fd)<0;
+    close(snap_fd);
+    if(snap_err || rename(tmp,path)<0){
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Resume from a snapshot made on a field of the same size: the level it
+   was played at, or 0 to start a new game */
+int snapshot_load(const char *path){
+    long long t0=now_ns();
+    SnapHeader h;
+    snap_fd=open(path,O_RDONLY);
+    if(snap_fd<0) return 0;
+    if(read(snap_fd,&h,sizeof(h))!=sizeof(h) || h.magic!=SNAP_MAGIC || h.version!=SNAP_VERSION
+       || h.game!=SCORE_GAME_SHOOTER || h.w!=max_x || h.h!=max_y || h.level<1 || h.level>4
+       || !snap_caps_ok(&h)){
+        close(snap_fd);
+        return 0;
+    }
+    uint64_t seed=sim_seed;
+    int was_stress=stress;
+    sim_seed=h.seed;
+    set_level(h.level);
+    init_game();
+    enemies_reserve(h.caps[0]);
+    bullets_reserve(h.caps[1]);
+    reg_reserve(&enemy_reg,h.caps[2]);
+    reg_reserve(&bullet_reg,h.caps[3]);
+    wheel.t=xrealloc(wheel.t,sizeof(Timer)*h.caps[4]);
+    wheel.cap=h.caps[4];
+    snap_err=0;
+    snap_sum=0xcbf29ce484222325ULL;
+    size_t n=walk_state(0,RW_READ);
+    close(snap_fd);
+    uint64_t check=h.check;
+    h.check=0;
+    if(snap_err || n!=h.size || fnv(snap_sum,&h,sizeof(h))!=check){
+        /* start over from scratch rather than trust it */
+        clear_lists();
+        sim_seed=sim_rng=seed;
+        stress=was_stress;
+        sim_tick=0;
+        return 0;
+    }
+    snap_resumed=1;
+    snap_resumed_tick=sim_tick;
+    snap_load_ns=now_ns()-t0;
+    return h.level;
+}
+
+/* Fork at the tick boundary; the child writes the snapshot and exits */
+void snapshot_start(){
+    if(snap_pid>0) return;
+    size_t n=sizeof(SnapHeader)+walk_state(0,RW_MEASURE);
+    long long t0=now_ns();
+    pid_t pid=fork();
+    if(pid==0) _exit(snapshot_write(snap_path)<0);
+    long long dt=now_ns()-t0;
+    if(pid<0){
+        snap_failed++;
+        return;
+    }
+    snap_pid=pid;
+    snap_started_at=t0;
+    snap_forks++;
+    snap_fork_ns+=dt;
+    if(dt>snap_fork_max) snap_fork_max=dt;
+    snap_bytes=n;
+}
+
+/* Reap the snapshot child if it is done (or wait for it) */
+void snapshot_poll(int block){
+    int st;
+    if(snap_pid<=0 || waitpid(snap_pid,&st,block?0:WNOHANG)!=snap_pid) return;
+    snap_pid=0;
+    if(WIFEXITED(st) && WEXITSTATUS(st)==0){
+        snap_written++;
+        snap_write_ns+=now_ns()-snap_started_at;
+    }
+    else snap_failed++;
+}
+
+/* -------- ZYGOTE -------- */
+void init_colors(){
+    start_color();
+    init_pair(PLAYER_COLOR, COLOR_GREEN, COLOR_BLACK);
+    init_pair(ENEMY_COLOR, COLOR_RED, COLOR_BLACK);
+    init_pair(BULLET_COLOR, COLOR_YELLOW, COLOR_BLACK);
+    init_pair(ENEMY_BULLET_COLOR, COLOR_MAGENTA, COLOR_BLACK);
+    init_pair(TEXT_COLOR, COLOR_CYAN, COLOR_BLACK);
+    init_pair(MENU_COLOR, COLOR_MAGENTA, COLOR_BLACK);
+}
+
+/* ZYGOTE_FDS descriptors in one SCM_RIGHTS message, with a byte of data
+   to carry it */
+int send_fds(int sock, const int *fds){
+    char byte=0;
+    char ctl[CMSG_SPACE(sizeof(int)*ZYGOTE_FDS)];
+    struct iovec iov={ &byte, 1 };
+    struct msghdr m={ .msg_iov=&iov, .msg_iovlen=1, .msg_control=ctl, .msg_controllen=sizeof(ctl) };
+    struct cmsghdr *c=CMSG_FIRSTHDR(&m);
+    c->cmsg_level=SOL_SOCKET;
+    c->cmsg_type=SCM_RIGHTS;
+    c->cmsg_len=CMSG_LEN(sizeof(int)*ZYGOTE_FDS);
+    memcpy(CMSG_DATA(c),fds,sizeof(int)*ZYGOTE_FDS);
+    return sendmsg(sock,&m,0)==1?0:-1;
+}
+
+int recv_fds(int sock, int *fds){
+    char byte;
+    char ctl[CMSG_SPACE(sizeof(int)*ZYGOTE_FDS)];
+    struct iovec iov={ &byte, 1 };
+    struct msghdr m={ .msg_iov=&iov, .msg_iovlen=1, .msg_control=ctl, .msg_controllen=sizeof(ctl) };
+    if(recvmsg(sock,&m,0)!=1) return -1;
+    struct cmsghdr *c=CMSG_FIRSTHDR(&m);
+    if(!c || c->cmsg_level!=SOL_SOCKET || c->cmsg_type!=SCM_RIGHTS) return -1;
+    if(c->cmsg_len!=CMSG_LEN(sizeof(int)*ZYGOTE_FDS)){
+        int n=(c->cmsg_len-CMSG_LEN(0))/sizeof(int);
+        for(int i=0;i<n;i++) close(((int *)CMSG_DATA(c))[i]);
+        return -1;
+    }
+    memcpy(fds,CMSG_DATA(c),sizeof(int)*ZYGOTE_FDS);
+    return 0;
+}
+
+/* Runs after the sprites and kernels are set up. Builds the screen on
+   /dev/null, then serves connections for good. Returns 0 in a session's
+   child, with fds 0-2 on the session's terminal and in a session of its
+   own, or -1 if the zygote could not start. */
+int zygote_main(const char *path){
+    struct sockaddr_un a={ .sun_family=AF_UNIX };
+    if(strlen(path)>=sizeof(a.sun_path)){
+        fprintf(stderr,"%s: socket path too long\n",path);
+        return -1;
+    }
+    strcpy(a.sun_path,path);
+    int null=open("/dev/null",O_RDWR);
+    if(null<0 || dup2(null,STDIN_FILENO)<0 || dup2(null,STDOUT_FILENO)<0){
+        perror("/dev/null");
+        return -1;
+    }
+    close(null);
+    zygote_screen=newterm(NULL,stdout,stdin);
+    if(!zygote_screen){
+        fprintf(stderr,"zygote: no terminfo entry for TERM\n");
+        return -1;
+    }
+    init_colors();
+
+    int ls=socket(AF_UNIX,SOCK_STREAM,0);
+    unlink(path);
+    if(ls<0 || bind(ls,(struct sockaddr *)&a,sizeof(a))<0 || listen(ls,ZYGOTE_BACKLOG)<0){
+        perror(path);
+        return -1;
+    }
+    signal(SIGCHLD,SIG_IGN);
+    fprintf(stderr,"Zygote: pid %d listening on %s\n",getpid(),path);
+    for(;;){
+        int c=accept(ls,NULL,NULL);
+        if(c<0){
+            if(errno==EINTR || errno==ECONNABORTED) continue;
+            perror("accept");
+            return -1;
+        }
+        long long t0=now_ns();
+        int fds[ZYGOTE_FDS];
+        if(recv_fds(c,fds)<0){
+            close(c);
+            continue;
+        }
+        pid_t pid=fork();
+        if(pid==0){
+            signal(SIGCHLD,SIG_DFL);
+            close(ls);
+            setsid();
+            for(int i=0;i<ZYGOTE_FDS;i++){
+                dup2(fds[i],i);
+                close(fds[i]);
+            }
+            zygote_conn=c;
+            zygote_spawned_at=t0;
+            return 0;
+        }
+        for(int i=0;i<ZYGOTE_FDS;i++) close(fds[i]);
+        close(c);
+        if(pid<0) perror("fork");
+        else fprintf(stderr,"Zygote: session %d forked in %.0f us\n",pid,(now_ns()-t0)/1e3);
+    }
+}
+
+/* In a session's child, in place of initscr(): the zygote's screen now
+   writes to the session's terminal, but took its tty modes and size from
+   /dev/null. Read both from the terminal, then leave and re-enter curses
+   so the terminal gets its init strings and a full repaint. */
+void zygote_attach(){
+    struct winsize ws;
+    def_shell_mode();
+    def_prog_mode();
+    endwin();
+    if(ioctl(STDOUT_FILENO,TIOCGWINSZ,&ws)==0 && ws.ws_row && ws.ws_col)
+        resizeterm(ws.ws_row,ws.ws_col);
+    refresh();
+}
+
+/* -C: hand this terminal to the zygote and wait until the game on it
+   closes the connection. The game is not in the terminal's foreground
+   process group, so ^C and ^\ land here and are ignored. */
+int zygote_client(const char *path){
+    struct sockaddr_un a={ .sun_family=AF_UNIX };
+    if(strlen(path)>=sizeof(a.sun_path)){
+        fprintf(stderr,"%s: socket path too long\n",path);
+        return 1;
+    }
+    strcpy(a.sun_path,path);
+    int s=socket(AF_UNIX,SOCK_STREAM,0);
+    int fds[ZYGOTE_FDS]={ STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    if(s<0 || connect(s,(struct sockaddr *)&a,sizeof(a))<0 || send_fds(s,fds)<0){
+        perror(path);
+        return 1;
+    }
+    signal(SIGINT,SIG_IGN);
+    signal(SIGQUIT,SIG_IGN);
+    char byte;
+    ssize_t n;
+    while((n=read(s,&byte,1))>0 || (n<0 && errno==EINTR));
+    return 0;
+}
+
+/* Time from the zygote taking the request to the first frame on screen */
+void note_first_frame(){
+    if(zygote_spawned_at && !first_frame_ns) first_frame_ns=now_ns()-zygote_spawned_at;
+}
+
+/* -------- DEBUG LOG -------- */
+/* Hot path: claim this thread's ring once, then one record store */
+void log_put(int fmt, long a, long b, long c, long d){
+    if(log_slot<0){
+        log_slot=atomic_fetch_add(&log_n_rings,1);
+        if(log_slot>=LOG_MAX_THREADS) log_slot=LOG_MAX_THREADS;
+    }
+    if(log_slot==LOG_MAX_THREADS) return;
+    LogRing *r=&log_rings[log_slot];
+    unsigned head=atomic_load_explicit(&r->head,memory_order_relaxed);
+    if(head-atomic_load_explicit(&r->tail,memory_order_acquire)==LOG_RING_RECS){
+        r->dropped++;
+        return;
+    }
+    LogRec *rec=&r->recs[head&(LOG_RING_RECS-1)];
+    rec->t_ns=now_ns();
+    rec->fmt=fmt;
+    rec->args[0]=a; rec->args[1]=b; rec->args[2]=c; rec->args[3]=d;
+    atomic_store_explicit(&r->head,head+1,memory_order_release);
+}
+
+int log_start(const char *path){
+    log_file=fopen(path,"w");
+    if(!log_file){
+        perror(path);
+        return -1;
+    }
+    atomic_store(&log_running,1);
+    pthread_create(&log_tid,NULL,log_main,NULL);
+    return 0;
+}
+
+void log_stop(){
+    if(!log_file) return;
+    atomic_store(&log_running,0);
+    pthread_join(log_tid,NULL);
+    unsigned long dropped=0;
+    int n=atomic_load(&log_n_rings);
+    if(n>LOG_MAX_THREADS) n=LOG_MAX_THREADS;
+    for(int i=0;i<n;i++) dropped+=log_rings[i].dropped;
+    fclose(log_file);
+    log_file=NULL;
+    printf("Log: %lu records from %d threads, %lu dropped\n",log_written,n,dropped);
+}
+
+/* Write out everything published so far, oldest first across rings;
+   returns how many records that was */
+int log_drain(){
+    int n=atomic_load(&log_n_rings),done=0;
+    if(n>LOG_MAX_THREADS) n=LOG_MAX_THREADS;
+    unsigned end[LOG_MAX_THREADS];
+    for(int i=0;i<n;i++) end[i]=atomic_load_explicit(&log_rings[i].head,memory_order_acquire);
+    for(;;){
+        int best=-1;
+        long long t=0;
+        for(int i=0;i<n;i++){
+            unsigned tail=atomic_load_explicit(&log_rings[i].tail,memory_order_relaxed);
+            if(tail==end[i]) continue;
+            LogRec *rec=&log_rings[i].recs[tail&(LOG_RING_RECS-1)];
+            if(best<0 || rec->t_ns<t){ best=i; t=rec->t_ns; }
+        }
+        if(best<0) return done;
+        LogRing *r=&log_rings[best];
+        unsigned tail=atomic_load_explicit(&r->tail,memory_order_relaxed);
+        LogRec *rec=&r->recs[tail&(LOG_RING_RECS-1)];
+        fprintf(log_file,"%lld.%09lld [%d] ",rec->t_ns/1000000000LL,rec->t_ns%1000000000LL,best);
+        fprintf(log_file,log_fmts[rec->fmt],rec->args[0],rec->args[1],rec->args[2],rec->args[3]);
+        fputc('\n',log_file);
+        atomic_store_explicit(&r->tail,tail+1,memory_order_release);
+        log_written++;
+        done++;
+    }
+}
+
+void *log_main(void *arg){
+    (void)arg;
+    while(atomic_load(&log_running)){
+        if(log_drain()) fflush(log_file);
+        usleep(LOG_DRAIN_US);
+    }
+    log_drain();
+    return NULL;
+}
+
+/* Count total bytes and the bytes spent in SGR (ESC [ ... m) sequences */
+void count_output(const unsigned char *buf, size_t n){
+    out_bytes+=n;
+    for(size_t i=0;i<n;i++){
+        unsigned char c=buf[i];
+        switch(out_esc_state){
+            case 0:
+                if(c==27){ out_esc_state=1; out_esc_len=1; }
+                break;
+            case 1:
+                out_esc_state=c=='['?2:0;
+                out_esc_len++;
+                break;
+            case 2:
+                out_esc_len++;
+                if(c>=0x40&&c<=0x7e){
+                    if(c=='m') out_sgr_bytes+=out_esc_len;
+                    out_esc_state=0;
+                }
+                break;
+        }
+    }
+}
@@ -2,6 +2,25 @@
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Build: gcc snake_game.c -o snake -lncurses -pthread */
 
 #define EASY_DELAY   150000
 #define MEDIUM_DELAY 100000
@@ -10,14 +29,67 @@
 /* Start length (change this) */
 #define INITIAL_SNAKE_LEN 12
 
-typedef struct SnakeSegment {
+#define INPUTQ_SIZE 256
+
+/* A tick that overruns the schedule by more than this many periods
+   restarts it from now instead of bursting to catch up */
+#define PACE_SLACK 4
+
+/* Distinct allocation sites the heap instrumentation can tell apart */
+#define HEAP_SITES 32
+
+/* High-score file shared by both games: one table per game and level */
+#define SCORE_MAGIC 0x54545953u
+#define SCORE_GAMES 2
+#define SCORE_LEVELS 3
+#define SCORE_TOP 10
+#define SCORE_GAME_SNAKE 0
+#define SCORE_GAME_SHOOTER 1
+
+/* Replays (-w): file magic and layout version, and how many moves apart
+   the state hash chain is written out */
+#define REPLAY_MAGIC 0x52595454u
+#define REPLAY_VERSION 2
+#define REPLAY_HASH_EVERY 8
+#define REPLAY_HASH (-1)
+
+/* Rewind (hold R): moves kept (a power of two), moves undone per tick
+   while rewinding, and how long one press of the key keeps it going */
+#define REWIND_MOVES 4096
+#define REWIND_SPEED 10
+#define REWIND_HOLD_MS 200
+
+/* Snapshots (-k): file magic and layout version (shared with the
+   shooter, whose files say which game they are), and the default seconds
+   between them */
+#define SNAP_MAGIC 0x53535454u
+#define SNAP_VERSION 1
+#define SNAP_SECS 10
+
+/* Zygote (-Z): pending connections it queues, and the fds a session
+   hands over (its stdin, stdout and stderr) */
+#define ZYGOTE_BACKLOG 64
+#define ZYGOTE_FDS 3
+
+/* Debug log (-l): threads that can log, records per thread ring (a power
+   of two), and how often the drain thread empties them */
+#define LOG_MAX_THREADS 4
+#define LOG_RING_RECS 1024
+#define LOG_DRAIN_US 50000
+
+/* Address space reserved for each frame's arena; pages are committed on use */
+#define FRAME_ARENA_RESERVE ((size_t)16 << 20)
+
+typedef struct {
     int x, y;
-    struct SnakeSegment *next;
-} SnakeSegment;
+} Cell;
 
+/* The body is a ring of cells that can hold the whole play area, so
+   moving never allocates. Segment 0 (the head) is body[head], segment k
+   sits k slots behind it. */
 typedef struct {
-    SnakeSegment *head;
-    SnakeSegment *tail;
+    Cell *body;
+    int cap, head, len;
     int dir_x, dir_y;
 } Snake;
 
@@ -25,52 +97,436 @@ typedef struct {
     int x, y;
 } Food;
 
+/* What undoing one move needs: the tail cell it popped, or the cell the
+   food sat in if it ate instead. The head it pushed is segment 0. */
+typedef struct {
+    short x, y;
+    unsigned char ate;
+} MoveDelta;
+
+/* Bump arena over one reserved mapping; reset drops everything at once */
+typedef struct {
+    char *base;
+    size_t used, cap;
+} Arena;
+
+/* Immutable copy of everything the renderer needs for one frame */
+typedef struct {
+    unsigned long tick;
+    unsigned long skipped;
+    int score;
+    int paused;
+    int rewinding;
+    unsigned long tps;          /* ticks in the last whole second (turbo) */
+    Food food;
+    int n_segs;
+    int *seg_xy;            /* from arena, reset by each snapshot */
+    Arena arena;
+    unsigned long heap_tick;    /* heap calls in this tick (-m) */
+    size_t heap_live;
+    long rss_kb;
+} Frame;
+
+typedef struct {
+    int key;
+    unsigned long tick;     /* simulation tick the key arrived in */
+    long long t_ns;         /* CLOCK_MONOTONIC arrival time */
+} KeyEvent;
+
 int max_x, max_y;
 /* Play area (top-left origin and size) */
 int play_x0, play_y0, play_w, play_h;
 
 Snake snake;
+/* Snake segments per play-area cell; 2 under the head means it bit itself */
+unsigned char *occupied;
+
+/* Incremental state hash: the XOR of a Zobrist key per body segment's
+   cell plus rotated keys for the head, tail and food cells, updated as
+   the head is pushed and the tail popped; heading, length and score are
+   mixed in when it is read. -X rehashes from scratch after every move
+   and counts disagreements. */
+uint64_t *zobrist;
+uint64_t zhash = 0;
+int hash_check = 0;
+unsigned long hash_checked = 0, hash_bad = 0, hash_first_bad = 0;
+
+/* Rewind log: one delta per move in a fixed ring, live in [rw_tail,
+   rw_head), a full ring dropping its oldest. Undoing pops the newest, so
+   memory goes with moves made and a step back is O(1). Food that gets
+   eaten again after a rewind may respawn elsewhere: rand() is not wound
+   back. Off while a replay is written, and a rewound game is practice,
+   so its score is not recorded. */
+MoveDelta rewind_log[REWIND_MOVES];
+unsigned rw_head = 0, rw_tail = 0;
+long long rewind_until = 0;
+unsigned long moves_rewound = 0;
 Food food;
 int score = 0;
 int paused = 0;
+int level;
+/* Food placement draws from rand(), seeded with this */
+unsigned game_seed;
+/* Moves made so far; replays count their ticks in these */
+unsigned long moves = 0;
 int delay_time;
 
+/* Pacing. The level sets delay_time; -r overrides the tick rate (0:
+   uncapped), on an absolute schedule tick_ns apart. Frames are taken at
+   most every frame_ns (by default one per level tick); ticks in between
+   are decimated, never snapshotted. */
+int turbo = 0, sim_hz = -1, render_fps = 0;
+long long tick_ns, frame_ns;
+long long play_start = 0, next_tick_at = 0, next_frame_at = 0;
+unsigned long ticks_run = 0, frames_decimated = 0;
+/* Ticks per whole wall-clock second: the last one and the slowest */
+long long tps_window = 0;
+unsigned long tps_count = 0, tps_last = 0, tps_min = 0;
+
+/* Threaded mode: the simulation publishes frames through a lock-free
+   triple buffer, the render thread presents the newest one. frames[tb_back]
+   is sim-owned, frames[tb_front] render-owned, tb_mid holds the latest
+   published frame with TB_FRESH set until the renderer picks it up. */
+#define TB_FRESH 4
+int threaded = 0;
+Frame frames[3];
+int tb_back = 0, tb_front = 1;
+atomic_int tb_mid = 2;
+atomic_int render_running = 0;
+pthread_t render_tid;
+
+atomic_ulong sim_tick = 0;
+unsigned long frames_published = 0, frames_skipped = 0;
+unsigned long frames_rendered = 0, frames_duplicated = 0;
+
+/* The input thread blocks on the tty, decodes keys and pushes them into
+   an SPSC ring; the simulation takes one key per tick from it. */
+KeyEvent inputq[INPUTQ_SIZE];
+atomic_uint inputq_head = 0, inputq_tail = 0;
+atomic_int input_running = 0;
+pthread_t input_tid;
+unsigned long keys_applied = 0, keys_dropped = 0;
+long long input_lat_sum = 0, input_lat_max = 0;
+unsigned long input_lag_sum = 0, input_lag_max = 0;     /* in ticks */
+
+/* Session statistics printed at exit (-v) */
+int show_stats = 0;
+
+/* Heap calls made through xmalloc() and friends; once play starts there
+   should be none */
+unsigned long heap_calls = 0, heap_calls_at_start = 0;
+
+/* Opt-in heap instrumentation (-m): calls and bytes per allocation site
+   (the calling function), live and peak bytes by malloc_usable_size(),
+   calls per tick and peak RSS */
+typedef struct {
+    const char *site;
+    unsigned long calls;
+    size_t bytes;
+} HeapSite;
+
+int mem_stats = 0;
+HeapSite heap_sites[HEAP_SITES];
+int n_heap_sites = 0;
+size_t heap_live = 0, heap_peak = 0;
+unsigned long heap_tick_calls = 0, heap_tick_max = 0;
+
+/* Background snapshots (-k path). Every snap_secs the game fork()s
+   between moves and the child writes the copy-on-write image of the game
+   while the parent plays on: path.tmp, fsynced, then renamed over path,
+   so a crash leaves the previous snapshot whole. The body is written tail
+   first, the ring at most two runs. One child at a time, reaped without
+   blocking. Started with -k and the file present, the game resumes from
+   it; food placement then draws from rand() seeded afresh. */
+typedef struct {
+    uint32_t magic, version;
+    uint64_t seed;
+    int32_t game, level, w, h;
+    int32_t score, len, dir_x, dir_y, food_x, food_y;
+    uint64_t moves;
+    uint64_t check;             /* FNV-1a of the header (check 0) and body */
+} SnapHeader;
+
+const char *snap_path = NULL;
+int snap_secs = SNAP_SECS;
+int snap_fd = -1, snap_resumed = 0;
+SnapHeader snap_hdr;
+pid_t snap_pid = 0;
+long long snap_next_at = 0, snap_started_at = 0;
+long long snap_fork_ns = 0, snap_fork_max = 0, snap_write_ns = 0, snap_load_ns = 0;
+unsigned long snap_forks = 0, snap_written = 0, snap_failed = 0;
+size_t snap_bytes = 0;
+
+/* A zygote (-Z) is linked and relocated already and has a curses screen,
+   with its terminfo entry and color pairs, built on /dev/null. Each
+   connection passes in a terminal's fds and gets a forked child playing
+   on them; -C is the client that does that for its own terminal. */
+SCREEN *zygote_screen = NULL;
+int zygote_conn = -1;
+long long zygote_spawned_at = 0, first_frame_ns = 0;
+
+/* Structured debug log (-l path). A call stores a format id, the time and
+   up to four integer arguments in its thread's own ring and never blocks
+   or formats; a full ring counts a drop. The drain thread merges the
+   rings by time and writes the text. */
+enum { LOG_MOVE, LOG_KEY, NUM_LOG_FMTS };
+
+static const char *const log_fmts[NUM_LOG_FMTS] = {
+    [LOG_MOVE] = "tick %ld: head %ld,%ld length %ld",
+    [LOG_KEY] = "key %ld read at tick %ld (%ld queued, %ld dropped)",
+};
+
+typedef struct {
+    long long t_ns;
+    int fmt, pad;
+    long args[4];
+} LogRec;
+
+typedef struct {
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
+    unsigned long dropped;
+    LogRec recs[LOG_RING_RECS];
+} LogRing;
+
+FILE *log_file = NULL;
+LogRing log_rings[LOG_MAX_THREADS];
+atomic_int log_n_rings = 0;
+_Thread_local int log_slot = -1;
+atomic_int log_running = 0;
+pthread_t log_tid;
+unsigned long log_written = 0;
+
+/* Persistent high scores in the same mapped file as the shooter's (keep
+   the two copies of the layout identical). Readers go by each table's
+   seq, odd while it changes; a score that places takes a short fcntl()
+   lock on its own table's bytes. */
+typedef struct {
+    int32_t score;
+    uint32_t when;
+    char name[24];
+} ScoreEntry;
+
+typedef struct {
+    _Alignas(64) atomic_uint seq;
+    int32_t n;
+    ScoreEntry top[SCORE_TOP];
+} ScoreTable;
+
+typedef struct {
+    atomic_uint magic;
+    ScoreTable tables[SCORE_GAMES][SCORE_LEVELS];
+} ScoreFile;
+
+const char *score_path = NULL;
+
+/* Replay file, shared in layout with the shooter: a header, then records
+   in move order. A key record holds a key applied before the move that
+   starts at its tick; a hash record holds the state hash chain after the
+   move that ended at its tick. The header's tick count and score are
+   filled in when the game ends. */
+typedef struct {
+    uint32_t magic, version;
+    uint64_t seed;
+    int32_t game, level;
+    int32_t x0, y0, w, h;       /* play area the game was played in */
+    int32_t ticks, score;
+} ReplayHeader;
+
+typedef struct {
+    uint32_t tick;
+    int32_t key;                /* or REPLAY_HASH */
+    uint64_t hash;
+} ReplayRec;
+
+/* Verdict on one replay, written by a verifier worker into shared memory */
+typedef struct {
+    int status;                 /* 0 accepted, 1 rejected, 2 unreadable */
+    int tick, score;
+    long ticks;
+    char why[64];
+} VerifyResult;
+
+FILE *replay_out = NULL;
+const char *replay_path = NULL;
+ReplayHeader replay_hdr;
+uint64_t replay_chain;
+long replay_recs = 0;
+
+/* Log calls compile to one predictable branch while logging is off */
+#define LOG(fmt, a, b, c, d) do { if (log_file) log_put((fmt), (a), (b), (c), (d)); } while (0)
+
+/* Allocation sites record the function they are in */
+#define xmalloc(n) heap_malloc((n), __func__)
+#define xcalloc(n, size) heap_calloc((n), (size), __func__)
+#define xrealloc(p, n) heap_realloc((p), (n), __func__)
+#define xfree(p) heap_free((p), __func__)
+
 void init_game();
 void draw_borders();
-void draw_snake();
+void draw_snake(const Frame *f);
+void render_frame(const Frame *f);
+void snapshot_frame(Frame *f);
+void publish_frame();
+Frame *acquire_frame();
+void *render_main(void *arg);
+void start_render_thread();
+void stop_render_thread();
+long long now_ns();
+void pace_tick();
+int frame_due(long long now);
+int decode_key(const unsigned char *buf, int len, int *key);
+void *input_main(void *arg);
+void start_input_thread();
+void stop_input_thread();
+int next_key(KeyEvent *ev);
 void move_snake();
 int check_collision();
 void spawn_food();
-void end_game();
+int end_game();
 void erase_tail();
 int show_menu();
 void free_snake();
+Cell *snake_seg(int k);
+unsigned char *occupied_at(int x, int y);
+void arena_init(Arena *a, size_t reserve);
+void *arena_alloc(Arena *a, size_t n);
+void arena_release(Arena *a);
+void *heap_malloc(size_t n, const char *site);
+void *heap_calloc(size_t n, size_t size, const char *site);
+void *heap_realloc(void *p, size_t n, const char *site);
+void heap_free(void *p, const char *site);
+void heap_note(const char *site, size_t bytes);
+long peak_rss_kb();
+void print_heap_report(unsigned long play_calls);
+ScoreFile *scores_open(const char *path, int *fd);
+void scores_close(ScoreFile *sf, int fd);
+void score_read(ScoreTable *t, ScoreTable *out);
+int score_submit(ScoreFile *sf, int fd, int game, int level, int score);
+void record_score(int game, int level, int score);
+void steer(int ch);
+void rewind_push(int x, int y, int ate);
+int undo_move();
+uint64_t zkey(int x, int y, int rot);
+uint64_t zobrist_full();
+uint64_t state_hash();
+uint64_t state_hash_full();
+void check_state_hash();
+uint64_t chain_fold(uint64_t chain, uint64_t h);
+int replay_begin(const char *path);
+void replay_key(int ch);
+void replay_tick();
+void replay_end();
+void verify_replay(const char *path, VerifyResult *r);
+int verify_replays(int n, char **paths);
+uint64_t fnv(uint64_t h, const void *p, size_t n);
+int snapshot_write(const char *path);
+int snapshot_open(const char *path);
+void snapshot_load();
+void snapshot_start();
+void snapshot_poll(int block);
+void init_colors();
+int send_fds(int sock, const int *fds);
+int recv_fds(int sock, int *fds);
+int zygote_main(const char *path);
+void zygote_attach();
+int zygote_client(const char *path);
+void note_first_frame();
+void log_put(int fmt, long a, long b, long c, long d);
+int log_start(const char *path);
+void log_stop();
+int log_drain();
+void *log_main(void *arg);
 
-int main() {
-    initscr();
+int main(int argc, char **argv) {
+    int opt, verify = 0;
+    const char *log_path = NULL, *zygote_path = NULL, *client_path = NULL;
+    while ((opt = getopt(argc, argv, "tmvr:R:l:P:w:VXk:K:Z:C:")) != -1) {
+        if (opt == 't') threaded = 1;
+        else if (opt == 'm') mem_stats = 1;
+        else if (opt == 'v') show_stats = 1;
+        else if (opt == 'l') log_path = optarg;
+        else if (opt == 'P') score_path = optarg;
+        else if (opt == 'w') replay_path = optarg;
+        else if (opt == 'V') verify = 1;
+        else if (opt == 'X') hash_check = 1;
+        else if (opt == 'k') snap_path = optarg;
+        else if (opt == 'K' && atoi(optarg) > 0) snap_secs = atoi(optarg);
+        else if (opt == 'Z') zygote_path = optarg;
+        else if (opt == 'C') client_path = optarg;
+        else if (opt == 'r') {
+            sim_hz = atoi(optarg);
+            turbo = 1;
+        } else if (opt == 'R' && atoi(optarg) > 0) {
+            render_fps = atoi(optarg);
+            turbo = 1;
+        } else {
+            fprintf(stderr, "usage: %s [-t] [-m] [-v] [-r hz] [-R fps] [-l file] [-P file]\n"
+                    "       [-w file] [-X] [-k file] [-K secs] [-Z sock] [-C sock] [-V replay...]\n"
+                    "  -t      render on a separate thread\n"
+                    "  -m      heap instrumentation: calls per tick, live bytes, RSS and\n"
+                    "          allocation sites, on screen and at exit\n"
+                    "  -v      print input statistics at exit\n"
+                    "  -r hz   ticks per second instead of the level's (0 uncapped)\n"
+                    "  -R fps  most frames drawn per second (default: the level's rate)\n"
+                    "  -l file debug log, written by a background thread\n"
+                    "  -P file high-score file (default ~/.tty-games-scores)\n"
+                    "  -w file write a replay of the game\n"
+                    "  -X      check the incremental state hash against a full rehash\n"
+                    "          every move\n"
+                    "  -k file snapshot the game to file in the background, and resume\n"
+                    "          from it if it is there\n"
+                    "  -K secs seconds between snapshots (default %d)\n"
+                    "  -Z sock zygote: pre-initialize, then fork a game with the other\n"
+                    "          options for each terminal handed over on sock\n"
+                    "  -C sock play on this terminal through the zygote on sock\n"
+                    "  -V      verify the replays named after the options, one process per\n"
+                    "          core, and exit\n",
+                    argv[0], SNAP_SECS);
+            return 1;
+        }
+    }
+    if (snap_path && replay_path) {
+        fprintf(stderr, "%s: -k and -w cannot be combined: a resumed game has no replay\n", argv[0]);
+        return 1;
+    }
+    if (client_path) return zygote_client(client_path);
+    /* Threads do not survive fork(), so the log starts after */
+    if (zygote_path && zygote_main(zygote_path) < 0) return 1;
+    if (log_path && log_start(log_path) < 0) return 1;
+    if (verify) {
+        int rc = verify_replays(argc - optind, argv + optind);
+        log_stop();
+        return rc;
+    }
+
+    if (zygote_screen) zygote_attach();
+    else initscr();
     noecho();
     curs_set(FALSE);
+    cbreak();
     keypad(stdscr, TRUE);
     nodelay(stdscr, TRUE);
+    typeahead(-1);
     getmaxyx(stdscr, max_y, max_x);
 
-    start_color();
-    init_pair(1, COLOR_GREEN, COLOR_BLACK);   // Snake
-    init_pair(2, COLOR_RED, COLOR_BLACK);     // Food
-    init_pair(3, COLOR_CYAN, COLOR_BLACK);    // Borders
-    init_pair(4, COLOR_YELLOW, COLOR_BLACK);  // Score / Text
-    init_pair(5, COLOR_MAGENTA, COLOR_BLACK); // Menu highlight
+    if (!zygote_screen) init_colors();
 
-    srand(time(NULL));
+    /* Sessions forked by a zygote in the same second still differ */
+    game_seed = time(NULL) ^ (unsigned)getpid() << 16;
+    srand(game_seed);
 
-    // --- Show Level Menu ---
-    int level = show_menu();
+    // --- Show Level Menu, unless a snapshot says where we were ---
+    level = snap_path ? snapshot_open(snap_path) : 0;
+    if (!level) level = show_menu();
     switch (level) {
         case 1: delay_time = EASY_DELAY; break;
         case 2: delay_time = MEDIUM_DELAY; break;
         case 3: delay_time = HARD_DELAY; break;
         default: delay_time = MEDIUM_DELAY;
     }
+    tick_ns = sim_hz < 0 ? delay_time * 1000LL : sim_hz > 0 ? 1000000000LL / sim_hz : 0;
+    frame_ns = render_fps ? 1000000000LL / render_fps : delay_time * 1000LL;
 
     clear();
 
@@ -84,52 +540,80 @@ int main() {
     play_x0 = (max_x - play_w) / 2;
     play_y0 = (max_y - play_h) / 2;
 
-    init_game();
-    draw_borders();
+    /* Blanks take the snake pair (every pair has a black background), so
+       the head/tail cells that change each tick need no SGR switch */
+    bkgdset(' ' | COLOR_PAIR(1));
 
-    while (1) {
-        /* Score and level displayed above play area */
-        attron(COLOR_PAIR(4));
-        mvprintw(play_y0 - 1, play_x0, " Score: %d | Level: %s ",
-                 score,
-                 (delay_time == EASY_DELAY) ? "Easy" :
-                 (delay_time == MEDIUM_DELAY) ? "Medium" : "Hard");
-        attroff(COLOR_PAIR(4));
-
-        draw_snake();
-        attron(COLOR_PAIR(2));
-        mvaddch(food.y, food.x, '@');
-        attroff(COLOR_PAIR(2));
+    if (snap_fd >= 0) snapshot_load();
+    else init_game();
+    if (replay_path && replay_begin(replay_path) < 0) {
+        endwin();
+        return 1;
+    }
+    start_input_thread();
+    if (threaded) start_render_thread();
+    heap_calls_at_start = heap_calls;
+    play_start = next_tick_at = next_frame_at = tps_window = now_ns();
+    snap_next_at = play_start + snap_secs * 1000000000LL;
 
-        if (paused) {
-            attron(COLOR_PAIR(4));
-            mvprintw(play_y0 + play_h / 2, play_x0 + play_w / 2 - 6, "--- PAUSED ---");
-            attroff(COLOR_PAIR(4));
+    while (1) {
+        unsigned long heap_mark = heap_calls;
+        if (frame_due(now_ns())) {
+            snapshot_frame(&frames[tb_back]);
+            if (threaded) publish_frame();
+            else render_frame(&frames[tb_back]);
         } else {
-            /* Clear paused message area */
-            mvprintw(play_y0 + play_h / 2, play_x0 + play_w / 2 - 6, "               ");
+            frames_decimated++;
         }
+        pace_tick();
+        sim_tick++;
+        ticks_run++;
 
-        refresh();
-        usleep(delay_time);
-
-        int ch = getch();
+        KeyEvent ev;
+        int ch = next_key(&ev) ? ev.key : ERR;
+        /* A held R repeats faster than moves are made; take the run at once */
+        while (ch == 'r' || ch == 'R') {
+            if (!replay_out) rewind_until = ev.t_ns + REWIND_HOLD_MS * 1000000LL;
+            ch = next_key(&ev) ? ev.key : ERR;
+        }
         switch (ch) {
-            case KEY_UP:    if (!paused && snake.dir_y != 1) { snake.dir_x = 0; snake.dir_y = -1; } break;
-            case KEY_DOWN:  if (!paused && snake.dir_y != -1) { snake.dir_x = 0; snake.dir_y = 1; } break;
-            case KEY_LEFT:  if (!paused && snake.dir_x != 1) { snake.dir_x = -1; snake.dir_y = 0; } break;
-            case KEY_RIGHT: if (!paused && snake.dir_x != -1) { snake.dir_x = 1; snake.dir_y = 0; } break;
+            case KEY_UP: case KEY_DOWN: case KEY_LEFT: case KEY_RIGHT:
+                if (paused) break;
+                steer(ch);
+                if (replay_out) replay_key(ch);
+                break;
             case 'p': case 'P': paused = !paused; break;
-            case 'q': case 'Q': end_game(); return 0;
+            case 'q': case 'Q': return end_game();
         }
 
-        if (!paused) {
+        if (now_ns() < rewind_until) {
+            for (int k = 0; k < REWIND_SPEED && undo_move(); ++k) {}
+            if (hash_check) check_state_hash();
+        } else if (!paused) {
             move_snake();
+            if (hash_check) check_state_hash();
+            if (replay_out) replay_tick();
             if (check_collision()) {
-                end_game();
-                return 0;
+                /* a finished game is not resumed */
+                if (snap_path) {
+                    snapshot_poll(1);
+                    unlink(snap_path);
+                }
+                return end_game();
+            }
+        }
+
+        if (snap_path) {
+            snapshot_poll(0);
+            long long now = now_ns();
+            if (now >= snap_next_at) {
+                snapshot_start();
+                snap_next_at = now + snap_secs * 1000000000LL;
             }
         }
+
+        heap_tick_calls = heap_calls - heap_mark;
+        if (heap_tick_calls > heap_tick_max) heap_tick_max = heap_tick_calls;
     }
 
     endwin();
@@ -163,6 +647,7 @@ int show_menu() {
 
         mvprintw(max_y / 2 + 5, max_x / 2 - 11, "Use UP/DOWN and ENTER to select");
         refresh();
+        note_first_frame();
 
         ch = getch();
         if (ch == KEY_UP && choice > 1) choice--;
@@ -178,30 +663,50 @@ void init_game() {
     /* Initialize direction */
     snake.dir_x = 1;
     snake.dir_y = 0;
-    snake.head = snake.tail = NULL;
 
-    /* Create initial snake centered in play area */
+    snake.cap = play_w * play_h;
+    snake.body = xmalloc(sizeof(Cell) * snake.cap);
+    occupied = xcalloc(play_w * play_h, 1);
+
+    /* Fixed keys, so every run (and every replay check) agrees */
+    zobrist = xmalloc(sizeof(uint64_t) * play_w * play_h);
+    uint64_t z = 0x5eed5eedULL;
+    for (int c = 0; c < play_w * play_h; ++c) {
+        uint64_t k = (z += 0x9e3779b97f4a7c15ULL);
+        k = (k ^ (k >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        k = (k ^ (k >> 27)) * 0x94d049bb133111ebULL;
+        zobrist[c] = k ^ (k >> 31);
+    }
+
+    /* Create initial snake centered in play area, growing leftwards from
+       the head: the tail goes in first */
     int start_x = play_x0 + play_w / 2;
     int start_y = play_y0 + play_h / 2;
 
-    SnakeSegment *prev = NULL;
-    for (int i = 0; i < INITIAL_SNAKE_LEN; ++i) {
-        SnakeSegment *seg = malloc(sizeof(SnakeSegment));
-        seg->x = start_x - i;   /* grow leftwards from head */
-        seg->y = start_y;
-        seg->next = NULL;
-        if (prev) prev->next = seg;
-        else snake.head = seg;
-        prev = seg;
+    snake.head = -1;
+    snake.len = 0;
+    for (int i = INITIAL_SNAKE_LEN - 1; i >= 0; --i) {
+        snake.head = (snake.head + 1) % snake.cap;
+        snake.body[snake.head] = (Cell){ start_x - i, start_y };
+        snake.len++;
+        (*occupied_at(start_x - i, start_y))++;
     }
-    snake.tail = prev;
 
     score = 0;
     spawn_food();
+    zhash = zobrist_full();
+}
+
+Cell *snake_seg(int k) {
+    return &snake.body[(snake.head - k + snake.cap) % snake.cap];
+}
+
+unsigned char *occupied_at(int x, int y) {
+    return &occupied[(y - play_y0) * play_w + (x - play_x0)];
 }
 
 void draw_borders() {
-    attron(COLOR_PAIR(3));
+    attrset(COLOR_PAIR(3));
     /* top and bottom */
     for (int i = play_x0; i < play_x0 + play_w; ++i) {
         mvaddch(play_y0, i, '#');
@@ -212,80 +717,329 @@ void draw_borders() {
         mvaddch(i, play_x0, '#');
         mvaddch(i, play_x0 + play_w - 1, '#');
     }
-    attroff(COLOR_PAIR(3));
 }
 
-void draw_snake() {
-    attron(COLOR_PAIR(1));
+void draw_snake(const Frame *f) {
+    attrset(COLOR_PAIR(1));
     /* Draw full snake: head as 'O', body as 'o' */
-    SnakeSegment *cur = snake.head;
-    int first = 1;
-    while (cur) {
-        if (first) {
-            mvaddch(cur->y, cur->x, 'O');
-            first = 0;
+    for (int i = 0; i < f->n_segs; ++i)
+        mvaddch(f->seg_xy[2 * i + 1], f->seg_xy[2 * i], i == 0 ? 'O' : 'o');
+}
+
+/* Each color pair is set once: borders, snake, food, then all text */
+void render_frame(const Frame *f) {
+    erase();
+    draw_borders();
+    draw_snake(f);
+    attrset(COLOR_PAIR(2));
+    mvaddch(f->food.y, f->food.x, '@');
+
+    /* Score and level displayed above play area */
+    attrset(COLOR_PAIR(4));
+    mvprintw(play_y0 - 1, play_x0, " Score: %d | Level: %s ",
+             f->score,
+             (delay_time == EASY_DELAY) ? "Easy" :
+             (delay_time == MEDIUM_DELAY) ? "Medium" : "Hard");
+    if (threaded)
+        mvprintw(play_y0 + play_h, play_x0, " skip:%lu dup:%lu ", f->skipped, frames_duplicated);
+    if (turbo)
+        mvprintw(play_y0 - 1, play_x0 + play_w - 14, " tps:%lu ", f->tps);
+    if (mem_stats)
+        mvprintw(play_y0 + play_h, play_x0 + play_w - 28, " heap:%lu/t %zuK rss:%ldM ",
+                 f->heap_tick, f->heap_live >> 10, f->rss_kb >> 10);
+    if (f->rewinding)
+        mvprintw(play_y0 + play_h / 2, play_x0 + play_w / 2 - 6, "<<< REWIND <<<");
+    else if (f->paused)
+        mvprintw(play_y0 + play_h / 2, play_x0 + play_w / 2 - 6, "--- PAUSED ---");
+    attrset(A_NORMAL);
+
+    refresh();
+    note_first_frame();
+}
+
+/* Sleep until the next tick is due, counting this one towards the rate */
+void pace_tick() {
+    long long now = now_ns();
+    tps_count++;
+    if (now - tps_window >= 1000000000LL) {
+        tps_last = tps_count;
+        if (!tps_min || tps_count < tps_min) tps_min = tps_count;
+        tps_count = 0;
+        tps_window += 1000000000LL;
+        if (now - tps_window >= 1000000000LL) tps_window = now;
+    }
+    if (!tick_ns) return;
+    next_tick_at += tick_ns;
+    if (next_tick_at < now - PACE_SLACK * tick_ns) {
+        next_tick_at = now;
+    } else if (next_tick_at > now) {
+        struct timespec ts = { next_tick_at / 1000000000LL, next_tick_at % 1000000000LL };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+}
+
+/* Should this tick be drawn? Always, unless ticks run faster than the
+   render cap; then only once the cap's interval is up. */
+int frame_due(long long now) {
+    if (tick_ns && tick_ns >= frame_ns) return 1;
+    if (now < next_frame_at) return 0;
+    next_frame_at += frame_ns;
+    if (next_frame_at <= now) next_frame_at = now + frame_ns;
+    return 1;
+}
+
+/* The segment list is carved from the frame's own arena, which is reset
+   here; the frame being filled is always sim-owned, so nothing else can
+   still be reading it */
+void snapshot_frame(Frame *f) {
+    if (!f->arena.base) arena_init(&f->arena, FRAME_ARENA_RESERVE);
+    f->arena.used = 0;
+    f->seg_xy = arena_alloc(&f->arena, sizeof(int) * 2 * snake.len);
+    f->n_segs = snake.len;
+    for (int k = 0; k < snake.len; ++k) {
+        Cell *c = snake_seg(k);
+        f->seg_xy[2 * k] = c->x;
+        f->seg_xy[2 * k + 1] = c->y;
+    }
+
+    f->tick = sim_tick;
+    f->skipped = frames_skipped;
+    f->score = score;
+    f->paused = paused;
+    f->rewinding = now_ns() < rewind_until;
+    f->tps = tps_last;
+    f->food = food;
+    if (mem_stats) {
+        f->heap_tick = heap_tick_calls;
+        f->heap_live = heap_live;
+        f->rss_kb = peak_rss_kb();
+    }
+}
+
+/* Swap the finished back buffer into the middle slot. If the previous
+   frame there was never picked up, it is dropped. */
+void publish_frame() {
+    int prev = atomic_exchange(&tb_mid, tb_back | TB_FRESH);
+    if (prev & TB_FRESH) frames_skipped++;
+    tb_back = prev & ~TB_FRESH;
+    frames_published++;
+}
+
+/* Take the newest published frame, or NULL if none arrived since last time */
+Frame *acquire_frame() {
+    if (!(atomic_load(&tb_mid) & TB_FRESH)) return NULL;
+    int prev = atomic_exchange(&tb_mid, tb_front);
+    tb_front = prev & ~TB_FRESH;
+    return &frames[tb_front];
+}
+
+void *render_main(void *arg) {
+    (void)arg;
+    while (atomic_load(&render_running)) {
+        Frame *f = acquire_frame();
+        if (f) {
+            render_frame(f);
+            frames_rendered++;
         } else {
-            mvaddch(cur->y, cur->x, 'o');
+            frames_duplicated++;
         }
-        cur = cur->next;
+        usleep(frame_ns / 1000);
     }
-    attroff(COLOR_PAIR(1));
+    return NULL;
 }
 
-/* Remove last segment (tail) from screen and list */
-void erase_tail() {
-    if (!snake.head) return;
-    if (!snake.head->next) {
-        /* single segment: nothing to erase (we keep at least head) */
-        return;
+void start_render_thread() {
+    atomic_store(&render_running, 1);
+    pthread_create(&render_tid, NULL, render_main, NULL);
+}
+
+void stop_render_thread() {
+    atomic_store(&render_running, 0);
+    pthread_join(render_tid, NULL);
+}
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Decode one key from raw tty bytes. Returns bytes consumed, or 0 if the
+   buffer holds only the start of an escape sequence. */
+int decode_key(const unsigned char *buf, int len, int *key) {
+    if (buf[0] != 27) { *key = buf[0] == '\r' ? '\n' : buf[0]; return 1; }
+    if (len < 2) return 0;
+    if (buf[1] != '[' && buf[1] != 'O') { *key = 27; return 1; }
+    if (len < 3) return 0;
+    switch (buf[2]) {
+        case 'A': *key = KEY_UP; break;
+        case 'B': *key = KEY_DOWN; break;
+        case 'C': *key = KEY_RIGHT; break;
+        case 'D': *key = KEY_LEFT; break;
+        default: *key = ERR; break;
+    }
+    return 3;
+}
+
+void *input_main(void *arg) {
+    (void)arg;
+    unsigned char buf[64];
+    int len = 0;
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+    while (atomic_load(&input_running)) {
+        /* an unfinished escape sequence is dropped if nothing follows it */
+        if (poll(&pfd, 1, 50) <= 0) {
+            len = 0;
+            continue;
+        }
+        int n = read(STDIN_FILENO, buf + len, sizeof(buf) - len);
+        if (n <= 0) continue;
+        len += n;
+
+        long long t = now_ns();
+        unsigned long tick = atomic_load_explicit(&sim_tick, memory_order_relaxed);
+        int off = 0, used, key;
+        while (off < len && (used = decode_key(buf + off, len - off, &key)) > 0) {
+            off += used;
+            if (key == ERR) continue;
+            unsigned head = atomic_load_explicit(&inputq_head, memory_order_relaxed);
+            if (head - atomic_load_explicit(&inputq_tail, memory_order_acquire) == INPUTQ_SIZE) {
+                keys_dropped++;
+                continue;
+            }
+            inputq[head % INPUTQ_SIZE] = (KeyEvent){ key, tick, t };
+            atomic_store_explicit(&inputq_head, head + 1, memory_order_release);
+            LOG(LOG_KEY, key, (long)tick, (long)(head + 1 - atomic_load(&inputq_tail)), (long)keys_dropped);
+        }
+        memmove(buf, buf + off, len - off);
+        len -= off;
     }
-    SnakeSegment *curr = snake.head;
-    /* find second last */
-    while (curr->next && curr->next->next) {
-        curr = curr->next;
+    return NULL;
+}
+
+void start_input_thread() {
+    atomic_store(&input_running, 1);
+    pthread_create(&input_tid, NULL, input_main, NULL);
+}
+
+void stop_input_thread() {
+    atomic_store(&input_running, 0);
+    pthread_join(input_tid, NULL);
+}
+
+int next_key(KeyEvent *ev) {
+    unsigned tail = atomic_load_explicit(&inputq_tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&inputq_head, memory_order_acquire)) return 0;
+    *ev = inputq[tail % INPUTQ_SIZE];
+    atomic_store_explicit(&inputq_tail, tail + 1, memory_order_release);
+
+    /* One key is taken per tick, so a key applied in the tick after it
+       arrived has a lag of 1; more means it queued behind others */
+    long long lat = now_ns() - ev->t_ns;
+    unsigned long tick = sim_tick, lag = tick > ev->tick ? tick - ev->tick : 0;
+    input_lat_sum += lat;
+    if (lat > input_lat_max) input_lat_max = lat;
+    input_lag_sum += lag;
+    if (lag > input_lag_max) input_lag_max = lag;
+    keys_applied++;
+    return 1;
+}
+
+/* Remove last segment (tail) from the ring */
+void erase_tail() {
+    /* single segment: nothing to erase (we keep at least head) */
+    if (snake.len <= 1) return;
+    Cell *tail = snake_seg(snake.len - 1), *next = snake_seg(snake.len - 2);
+    zhash ^= zkey(tail->x, tail->y, 0) ^ zkey(tail->x, tail->y, 42) ^ zkey(next->x, next->y, 42);
+    (*occupied_at(tail->x, tail->y))--;
+    snake.len--;
+}
+
+/* Turn, unless that would reverse onto the body */
+void steer(int ch) {
+    switch (ch) {
+        case KEY_UP:    if (snake.dir_y != 1) { snake.dir_x = 0; snake.dir_y = -1; } break;
+        case KEY_DOWN:  if (snake.dir_y != -1) { snake.dir_x = 0; snake.dir_y = 1; } break;
+        case KEY_LEFT:  if (snake.dir_x != 1) { snake.dir_x = -1; snake.dir_y = 0; } break;
+        case KEY_RIGHT: if (snake.dir_x != -1) { snake.dir_x = 1; snake.dir_y = 0; } break;
     }
-    /* curr->next is tail */
-    mvaddch(curr->next->y, curr->next->x, ' ');
-    free(curr->next);
-    curr->next = NULL;
-    snake.tail = curr;
 }
 
 void move_snake() {
-    int new_x = snake.head->x + snake.dir_x;
-    int new_y = snake.head->y + snake.dir_y;
+    int new_x = snake_seg(0)->x + snake.dir_x;
+    int new_y = snake_seg(0)->y + snake.dir_y;
 
-    SnakeSegment *new_head = malloc(sizeof(SnakeSegment));
-    new_head->x = new_x;
-    new_head->y = new_y;
-    new_head->next = snake.head;
-    snake.head = new_head;
+    zhash ^= zkey(snake_seg(0)->x, snake_seg(0)->y, 21) ^ zkey(new_x, new_y, 21) ^ zkey(new_x, new_y, 0);
+    snake.head = (snake.head + 1) % snake.cap;
+    snake.body[snake.head] = (Cell){ new_x, new_y };
+    snake.len++;
 
-    /* If eaten food, grow and respawn food; otherwise drop tail */
+    /* If eaten food, grow and respawn food; otherwise drop tail. The tail
+       leaves before the head is counted in, so chasing it is safe. */
     if (new_x == food.x && new_y == food.y) {
         score += 10;
+        rewind_push(new_x, new_y, 1);
+        (*occupied_at(new_x, new_y))++;
+        zhash ^= zkey(food.x, food.y, 13);
         spawn_food();
+        zhash ^= zkey(food.x, food.y, 13);
     } else {
+        Cell *tail = snake_seg(snake.len - 1);
+        rewind_push(tail->x, tail->y, 0);
         erase_tail();
+        (*occupied_at(new_x, new_y))++;
     }
+    moves++;
+    LOG(LOG_MOVE, (long)sim_tick, new_x - play_x0, new_y - play_y0, snake.len);
+}
+
+void rewind_push(int x, int y, int ate) {
+    if (rw_head - rw_tail == REWIND_MOVES) rw_tail++;
+    rewind_log[rw_head++ & (REWIND_MOVES - 1)] = (MoveDelta){ x, y, ate };
+}
+
+/* Take back the newest logged move: pop the head, then put the tail or
+   the food back. The heading becomes that of the move before. Returns 0
+   once the log is empty. */
+int undo_move() {
+    if (rw_head == rw_tail) return 0;
+    MoveDelta d = rewind_log[--rw_head & (REWIND_MOVES - 1)];
+    Cell head = *snake_seg(0), *prev = snake_seg(1);
+    zhash ^= zkey(head.x, head.y, 21) ^ zkey(head.x, head.y, 0) ^ zkey(prev->x, prev->y, 21);
+    (*occupied_at(head.x, head.y))--;
+    snake.head = (snake.head - 1 + snake.cap) % snake.cap;
+    snake.len--;
+
+    if (d.ate) {
+        zhash ^= zkey(food.x, food.y, 13) ^ zkey(d.x, d.y, 13);
+        food.x = d.x;
+        food.y = d.y;
+        score -= 10;
+    } else {
+        Cell *tail = snake_seg(snake.len - 1);
+        zhash ^= zkey(tail->x, tail->y, 42) ^ zkey(d.x, d.y, 42) ^ zkey(d.x, d.y, 0);
+        snake.len++;
+        *snake_seg(snake.len - 1) = (Cell){ d.x, d.y };
+        (*occupied_at(d.x, d.y))++;
+    }
+
+    snake.dir_x = snake_seg(0)->x - snake_seg(1)->x;
+    snake.dir_y = snake_seg(0)->y - snake_seg(1)->y;
+    moves--;
+    moves_rewound++;
+    return 1;
 }
 
 int check_collision() {
-    int x = snake.head->x;
-    int y = snake.head->y;
+    int x = snake_seg(0)->x;
+    int y = snake_seg(0)->y;
 
     /* colliding with borders of play area */
     if (x <= play_x0 || x >= play_x0 + play_w - 1 || y <= play_y0 || y >= play_y0 + play_h - 1)
         return 1;
 
-    /* self-collision */
-    SnakeSegment *curr = snake.head->next;
-    while (curr) {
-        if (curr->x == x && curr->y == y)
-            return 1;
-        curr = curr->next;
-    }
-    return 0;
+    /* self-collision: the head shares its cell with a body segment */
+    return *occupied_at(x, y) > 1;
 }
 
 void spawn_food() {
@@ -293,17 +1047,7 @@ void spawn_food() {
         int fx = (rand() % (play_w - 2)) + play_x0 + 1;
         int fy = (rand() % (play_h - 2)) + play_y0 + 1;
 
-        SnakeSegment *curr = snake.head;
-        int conflict = 0;
-        while (curr) {
-            if (curr->x == fx && curr->y == fy) {
-                conflict = 1;
-                break;
-            }
-            curr = curr->next;
-        }
-
-        if (!conflict) {
+        if (!*occupied_at(fx, fy)) {
             food.x = fx;
             food.y = fy;
             break;
@@ -312,16 +1056,120 @@ void spawn_food() {
 }
 
 void free_snake() {
-    SnakeSegment *cur = snake.head;
-    while (cur) {
-        SnakeSegment *n = cur->next;
-        free(cur);
-        cur = n;
+    xfree(snake.body);
+    xfree(occupied);
+    xfree(zobrist);
+    snake.body = NULL;
+    occupied = NULL;
+    zobrist = NULL;
+    snake.len = 0;
+}
+
+void arena_init(Arena *a, size_t reserve) {
+    a->base = mmap(NULL, reserve, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (a->base == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    a->cap = reserve;
+    a->used = 0;
+}
+
+void *arena_alloc(Arena *a, size_t n) {
+    size_t off = (a->used + 15) & ~(size_t)15;
+    if (off + n > a->cap) {
+        fprintf(stderr, "arena exhausted (%zu bytes reserved)\n", a->cap);
+        abort();
+    }
+    a->used = off + n;
+    return a->base + off;
+}
+
+void arena_release(Arena *a) {
+    if (a->base) munmap(a->base, a->cap);
+    memset(a, 0, sizeof(*a));
+}
+
+/* Every heap call in the game goes through these (as xmalloc() etc.) */
+void *heap_malloc(size_t n, const char *site) {
+    void *p = malloc(n);
+    heap_calls++;
+    if (mem_stats) heap_note(site, malloc_usable_size(p));
+    return p;
+}
+
+void *heap_calloc(size_t n, size_t size, const char *site) {
+    void *p = calloc(n, size);
+    heap_calls++;
+    if (mem_stats) heap_note(site, malloc_usable_size(p));
+    return p;
+}
+
+void *heap_realloc(void *p, size_t n, const char *site) {
+    size_t old = mem_stats ? malloc_usable_size(p) : 0;
+    p = realloc(p, n);
+    heap_calls++;
+    if (mem_stats) {
+        heap_live -= old;
+        heap_note(site, malloc_usable_size(p));
+    }
+    return p;
+}
+
+void heap_free(void *p, const char *site) {
+    if (!p) return;
+    heap_calls++;
+    if (mem_stats) {
+        heap_live -= malloc_usable_size(p);
+        heap_note(site, 0);
     }
-    snake.head = snake.tail = NULL;
+    free(p);
+}
+
+/* Count a call at site that left bytes newly live */
+void heap_note(const char *site, size_t bytes) {
+    heap_live += bytes;
+    if (heap_live > heap_peak) heap_peak = heap_live;
+    int i = 0;
+    while (i < n_heap_sites && heap_sites[i].site != site) i++;
+    if (i == n_heap_sites) {
+        if (n_heap_sites == HEAP_SITES) return;
+        heap_sites[n_heap_sites++] = (HeapSite){ site, 0, 0 };
+    }
+    heap_sites[i].calls++;
+    heap_sites[i].bytes += bytes;
+}
+
+long peak_rss_kb() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
 }
 
-void end_game() {
+static int by_calls(const void *a, const void *b) {
+    const HeapSite *x = a, *y = b;
+    return (y->calls > x->calls) - (y->calls < x->calls);
+}
+
+/* Printed after teardown, so live bytes left over are leaks */
+void print_heap_report(unsigned long play_calls) {
+    if (!mem_stats) return;
+    printf("Heap: %lu calls (%lu during play), max %lu in one tick, live %zu KB (peak %zu KB), peak RSS %ld KB\n",
+           heap_calls, play_calls, heap_tick_max, heap_live >> 10, heap_peak >> 10, peak_rss_kb());
+    qsort(heap_sites, n_heap_sites, sizeof(HeapSite), by_calls);
+    for (int i = 0; i < n_heap_sites; ++i)
+        printf("  %-20s %8lu calls %10zu KB\n", heap_sites[i].site,
+               heap_sites[i].calls, heap_sites[i].bytes >> 10);
+}
+
+/* The exit status: under -m, heap calls during play are a failure */
+int end_game() {
+    double wall = (now_ns() - play_start) / 1e9;
+    if (replay_out) replay_end();
+    if (snap_path) snapshot_poll(1);
+    if (threaded) stop_render_thread();
+    stop_input_thread();
     nodelay(stdscr, FALSE);
     attron(COLOR_PAIR(4));
     mvprintw(play_y0 + play_h / 2 - 1, play_x0 + play_w / 2 - 5, "Game Over!");
@@ -331,7 +1179,725 @@ void end_game() {
     refresh();
     getch();
 
+    unsigned long play_heap_calls = heap_calls - heap_calls_at_start;
+    free_snake();
+    endwin();
+    if (moves_rewound)
+        printf("Rewind: %lu moves taken back; practice game, score not recorded\n", moves_rewound);
+    else
+        record_score(SCORE_GAME_SNAKE, level, score);
+    if (replay_path)
+        printf("Replay: %s, %d moves, %ld records\n", replay_path, replay_hdr.ticks, replay_recs);
+    if (show_stats && keys_applied)
+        printf("Input: %lu keys, %lu dropped, latency avg %lld us (%.2f ticks), "
+               "max %lld us (%lu ticks)\n",
+               keys_applied, keys_dropped,
+               input_lat_sum / (long long)keys_applied / 1000, (double)input_lag_sum / keys_applied,
+               input_lat_max / 1000, input_lag_max);
+    if (threaded)
+        printf("Frames: %lu published, %lu skipped, %lu rendered, %lu duplicated\n",
+               frames_published, frames_skipped, frames_rendered, frames_duplicated);
+    if (turbo && ticks_run) {
+        printf("Rate: %lu ticks in %.1f s, %.0f ticks/s", ticks_run, wall, ticks_run / wall);
+        if (tps_min) printf(" (slowest second %lu)", tps_min);
+        printf(", %lu ticks decimated\n", frames_decimated);
+    }
+    if (hash_check)
+        printf("Hash check: %lu moves, %lu mismatches (first at move %lu)\n",
+               hash_checked, hash_bad, hash_first_bad);
+    if (snap_resumed)
+        printf("Resumed: %s at move %lu, loaded in %.2f ms\n", snap_path, (unsigned long)snap_hdr.moves,
+               snap_load_ns / 1e6);
+    if (snap_forks)
+        printf("Snapshots: %lu written every %d s, %lu failed, fork avg %.0f us max %.0f us, "
+               "%zu bytes, child reaped %.1f ms after the fork on average\n",
+               snap_written, snap_secs, snap_failed, snap_fork_ns / 1e3 / snap_forks, snap_fork_max / 1e3,
+               snap_bytes, snap_written ? snap_write_ns / 1e6 / snap_written : 0.0);
+    if (zygote_spawned_at)
+        printf("Session: forked by zygote %d, first frame %.2f ms after the request\n",
+               getppid(), first_frame_ns / 1e6);
+    for (int i = 0; i < 3; ++i) arena_release(&frames[i].arena);
+    log_stop();
+    print_heap_report(play_heap_calls);
+    if (mem_stats && play_heap_calls) {
+        fprintf(stderr, "heap: %lu calls during play, expected none\n", play_heap_calls);
+        return 1;
+    }
+    return 0;
+}
+
+/* Map the score file, creating or growing it as needed; NULL if it
+   cannot be used. An all-zero file is a valid empty one. */
+ScoreFile *scores_open(const char *path, int *fd) {
+    *fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (*fd < 0) return NULL;
+    struct stat st;
+    if (fstat(*fd, &st) < 0 ||
+        (st.st_size < (off_t)sizeof(ScoreFile) && ftruncate(*fd, sizeof(ScoreFile)) < 0)) {
+        close(*fd);
+        return NULL;
+    }
+    ScoreFile *sf = mmap(NULL, sizeof(ScoreFile), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (sf == MAP_FAILED) {
+        close(*fd);
+        return NULL;
+    }
+    unsigned zero = 0;
+    if (!atomic_compare_exchange_strong(&sf->magic, &zero, SCORE_MAGIC) && zero != SCORE_MAGIC) {
+        scores_close(sf, *fd);
+        return NULL;
+    }
+    return sf;
+}
+
+void scores_close(ScoreFile *sf, int fd) {
+    munmap(sf, sizeof(ScoreFile));
+    close(fd);
+}
+
+/* Consistent copy of a table without taking its lock */
+void score_read(ScoreTable *t, ScoreTable *out) {
+    unsigned s0, s1;
+    do {
+        while ((s0 = atomic_load_explicit(&t->seq, memory_order_acquire)) & 1) sched_yield();
+        out->n = t->n;
+        memcpy(out->top, t->top, sizeof(out->top));
+        atomic_thread_fence(memory_order_acquire);
+        s1 = atomic_load_explicit(&t->seq, memory_order_relaxed);
+    } while (s0 != s1);
+    if (out->n < 0 || out->n > SCORE_TOP) out->n = 0;
+}
+
+/* Insert score in the table for game and level; returns its rank from 0,
+   or -1 if it did not place. A score too low to place is turned away on
+   a lock-free read. Equal scores keep their older entry first. */
+int score_submit(ScoreFile *sf, int fd, int game, int level, int score) {
+    ScoreTable *t = &sf->tables[game][level], snap;
+    score_read(t, &snap);
+    if (snap.n == SCORE_TOP && score <= snap.top[SCORE_TOP - 1].score) return -1;
+
+    struct flock lk = { .l_type = F_WRLCK, .l_whence = SEEK_SET,
+                        .l_start = (char *)t - (char *)sf, .l_len = sizeof(ScoreTable) };
+    if (fcntl(fd, F_SETLKW, &lk) < 0) return -1;
+    /* A writer that died mid-insert left seq odd; we hold the lock, so
+       nobody else is writing and the count can be trusted again */
+    unsigned seq = atomic_load_explicit(&t->seq, memory_order_relaxed) | 1;
+    atomic_store_explicit(&t->seq, seq, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    int n = t->n < 0 || t->n > SCORE_TOP ? 0 : t->n;
+    int pos = 0;
+    while (pos < n && t->top[pos].score >= score) pos++;
+    if (pos < SCORE_TOP) {
+        int keep = n < SCORE_TOP ? n : SCORE_TOP - 1;
+        memmove(&t->top[pos + 1], &t->top[pos], sizeof(ScoreEntry) * (keep - pos));
+        ScoreEntry *e = &t->top[pos];
+        const char *who = getenv("USER");
+        memset(e, 0, sizeof(*e));
+        e->score = score;
+        e->when = time(NULL);
+        snprintf(e->name, sizeof(e->name), "%s", who ? who : "?");
+        t->n = keep + 1;
+    } else {
+        pos = -1;
+    }
+    atomic_store_explicit(&t->seq, seq + 1, memory_order_release);
+    lk.l_type = F_UNLCK;
+    fcntl(fd, F_SETLK, &lk);
+    return pos;
+}
+
+/* Submit a finished game's score and print the table it went into;
+   called after endwin() */
+void record_score(int game, int level, int score) {
+    static const char *const names[SCORE_LEVELS] = { "Easy", "Medium", "Hard" };
+    char def[512];
+    const char *path = score_path;
+    if (level < 1 || level > SCORE_LEVELS) return;
+    if (!path) {
+        const char *home = getenv("HOME");
+        if (!home) return;
+        snprintf(def, sizeof(def), "%s/.tty-games-scores", home);
+        path = def;
+    }
+    int fd;
+    ScoreFile *sf = scores_open(path, &fd);
+    if (!sf) {
+        perror(path);
+        return;
+    }
+    int rank = score > 0 ? score_submit(sf, fd, game, level - 1, score) : -1;
+    ScoreTable t;
+    score_read(&sf->tables[game][level - 1], &t);
+    scores_close(sf, fd);
+    printf("High scores (%s):\n", names[level - 1]);
+    for (int i = 0; i < t.n; ++i) {
+        char day[16];
+        time_t when = t.top[i].when;
+        strftime(day, sizeof(day), "%Y-%m-%d", localtime(&when));
+        printf("  %2d. %8d  %-16.24s %s%s\n", i + 1, t.top[i].score, t.top[i].name, day,
+               i == rank ? "  <-" : "");
+    }
+}
+
+/* Zobrist key of a play-area cell; rot 0 is a body segment, 21 the head,
+   42 the tail and 13 the food */
+uint64_t zkey(int x, int y, int rot) {
+    uint64_t k = zobrist[(y - play_y0) * play_w + (x - play_x0)];
+    return rot ? k << rot | k >> (64 - rot) : k;
+}
+
+uint64_t zobrist_full() {
+    uint64_t h = 0;
+    for (int k = 0; k < snake.len; ++k) h ^= zkey(snake_seg(k)->x, snake_seg(k)->y, 0);
+    Cell *head = snake_seg(0), *tail = snake_seg(snake.len - 1);
+    return h ^ zkey(head->x, head->y, 21) ^ zkey(tail->x, tail->y, 42) ^ zkey(food.x, food.y, 13);
+}
+
+/* Everything a move depends on, in O(1) */
+uint64_t state_hash() {
+    uint64_t h = (uint64_t)(uint32_t)(snake.dir_x * 3 + snake.dir_y) << 32 | (uint32_t)snake.len;
+    return zhash ^ chain_fold(h, (uint32_t)score);
+}
+
+/* The same from scratch, for -X */
+uint64_t state_hash_full() {
+    uint64_t h = (uint64_t)(uint32_t)(snake.dir_x * 3 + snake.dir_y) << 32 | (uint32_t)snake.len;
+    return zobrist_full() ^ chain_fold(h, (uint32_t)score);
+}
+
+void check_state_hash() {
+    hash_checked++;
+    if (state_hash() == state_hash_full()) return;
+    if (!hash_bad++) hash_first_bad = moves;
+}
+
+/* splitmix64 finalizer over the chain and the new state */
+uint64_t chain_fold(uint64_t chain, uint64_t h) {
+    uint64_t z = chain ^ h;
+    z += 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+int replay_begin(const char *path) {
+    replay_out = fopen(path, "wb");
+    if (!replay_out) {
+        perror(path);
+        return -1;
+    }
+    replay_hdr = (ReplayHeader){ REPLAY_MAGIC, REPLAY_VERSION, game_seed, SCORE_GAME_SNAKE,
+                                 level, play_x0, play_y0, play_w, play_h, 0, 0 };
+    replay_chain = game_seed;
+    fwrite(&replay_hdr, sizeof(replay_hdr), 1, replay_out);
+    return 0;
+}
+
+void replay_key(int ch) {
+    ReplayRec r = { moves, ch, 0 };
+    fwrite(&r, sizeof(r), 1, replay_out);
+    replay_recs++;
+}
+
+/* After each move: fold the state into the chain, write it out now and then */
+void replay_tick() {
+    replay_chain = chain_fold(replay_chain, state_hash());
+    if (moves % REPLAY_HASH_EVERY) return;
+    ReplayRec r = { moves, REPLAY_HASH, replay_chain };
+    fwrite(&r, sizeof(r), 1, replay_out);
+    replay_recs++;
+}
+
+void replay_end() {
+    replay_hdr.ticks = moves;
+    replay_hdr.score = score;
+    fseek(replay_out, 0, SEEK_SET);
+    fwrite(&replay_hdr, sizeof(replay_hdr), 1, replay_out);
+    fclose(replay_out);
+    replay_out = NULL;
+}
+
+/* Re-play one replay through move_snake() and check_collision(), stopping
+   at the first chain value that does not match */
+void verify_replay(const char *path, VerifyResult *r) {
+    ReplayHeader h;
+    ReplayRec rec;
+    FILE *f = fopen(path, "rb");
+    *r = (VerifyResult){ 2, 0, 0, 0, "" };
+    if (!f || fread(&h, sizeof(h), 1, f) != 1) {
+        snprintf(r->why, sizeof(r->why), "cannot read");
+        if (f) fclose(f);
+        return;
+    }
+    if (h.magic != REPLAY_MAGIC || h.version != REPLAY_VERSION || h.game != SCORE_GAME_SNAKE ||
+        h.w < 4 || h.h < 4 || h.w > 4096 || h.h > 4096 || h.x0 < 0 || h.y0 < 0 || h.ticks < 0) {
+        snprintf(r->why, sizeof(r->why), "not a snake replay");
+        fclose(f);
+        return;
+    }
+    play_x0 = h.x0;
+    play_y0 = h.y0;
+    play_w = h.w;
+    play_h = h.h;
+    srand(h.seed);
+    moves = 0;
+    init_game();
+
+    uint64_t chain = h.seed;
+    int have = fread(&rec, sizeof(rec), 1, f) == 1, dead = 0;
+    r->status = 1;
+    for (int t = 0; ; ++t) {
+        for (; have && rec.tick <= (uint32_t)t; have = fread(&rec, sizeof(rec), 1, f) == 1) {
+            if (rec.tick < (uint32_t)t) {
+                snprintf(r->why, sizeof(r->why), "records out of order");
+                goto done;
+            }
+            if (rec.key == REPLAY_HASH) {
+                if (rec.hash != chain) {
+                    snprintf(r->why, sizeof(r->why), "state diverged");
+                    goto done;
+                }
+            } else if (rec.key == KEY_UP || rec.key == KEY_DOWN ||
+                       rec.key == KEY_LEFT || rec.key == KEY_RIGHT) {
+                steer(rec.key);
+            } else {
+                snprintf(r->why, sizeof(r->why), "bad key %d", rec.key);
+                goto done;
+            }
+        }
+        if (t == h.ticks) break;
+        if (dead) {
+            snprintf(r->why, sizeof(r->why), "game over before the last move");
+            goto done;
+        }
+        move_snake();
+        chain = chain_fold(chain, state_hash());
+        dead = check_collision();
+        r->tick = t + 1;
+    }
+    if (have) snprintf(r->why, sizeof(r->why), "records past the last move");
+    else if (score != h.score) snprintf(r->why, sizeof(r->why), "claims %d, scored %d", h.score, score);
+    else r->status = 0;
+done:
+    r->score = score;
+    r->ticks = moves;
     free_snake();
+    fclose(f);
+}
+
+/* Verify replays on one worker process per core; each claims the next
+   replay from a shared counter. Exit status 1 if any was not accepted. */
+int verify_replays(int n, char **paths) {
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers > n) workers = n;
+    if (workers < 1) workers = 1;
+    size_t size = (sizeof(atomic_int) + sizeof(VerifyResult) * n + 15) & ~(size_t)15;
+    char *shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    atomic_int *next = (atomic_int *)shared;
+    VerifyResult *res = (VerifyResult *)(shared + 16);
+    atomic_store(next, 0);
+    for (int i = 0; i < n; ++i) res[i] = (VerifyResult){ 2, 0, 0, 0, "not run" };
+
+    fflush(stdout);
+    long long t0 = now_ns();
+    for (int w = 0; w < workers; ++w) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            break;
+        }
+        if (pid) continue;
+        for (int i; (i = atomic_fetch_add(next, 1)) < n; ) verify_replay(paths[i], &res[i]);
+        _exit(0);
+    }
+    while (wait(NULL) > 0);
+    double wall = (now_ns() - t0) / 1e9;
+
+    long ticks = 0;
+    int bad = 0;
+    for (int i = 0; i < n; ++i) {
+        ticks += res[i].ticks;
+        if (res[i].status == 0) {
+            printf("%s: ok, score %d in %ld moves\n", paths[i], res[i].score, res[i].ticks);
+        } else {
+            bad++;
+            if (res[i].status == 1)
+                printf("%s: rejected at move %d: %s\n", paths[i], res[i].tick, res[i].why);
+            else
+                printf("%s: %s\n", paths[i], res[i].why);
+        }
+    }
+    printf("Verified %d replays, %d not accepted, %ld moves in %.2f s (%.0f moves/s) on %d processes\n",
+           n, bad, ticks, wall, wall > 0 ? ticks / wall : 0.0, workers);
+    munmap(shared, size);
+    return bad ? 1 : 0;
+}
+
+uint64_t fnv(uint64_t h, const void *p, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        h ^= ((const unsigned char *)p)[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Runs in the forked child: only system calls, no heap and no stdio */
+int snapshot_write(const char *path) {
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) return -1;
+    SnapHeader h = { SNAP_MAGIC, SNAP_VERSION, game_seed, SCORE_GAME_SNAKE, level, max_x, max_y,
+                     score, snake.len, snake.dir_x, snake.dir_y, food.x, food.y, moves, 0 };
+    int first = snake.head - snake.len + 1;
+    const Cell *a = first >= 0 ? &snake.body[first] : &snake.body[snake.cap + first];
+    size_t na = first >= 0 ? (size_t)snake.len : (size_t)-first;
+    size_t nb = snake.len - na;
+    h.check = fnv(fnv(fnv(0xcbf29ce484222325ULL, &h, sizeof(h)), a, sizeof(Cell) * na),
+                  snake.body, sizeof(Cell) * nb);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    int bad = write(fd, &h, sizeof(h)) != sizeof(h)
+              || write(fd, a, sizeof(Cell) * na) != (ssize_t)(sizeof(Cell) * na)
+              || (nb && write(fd, snake.body, sizeof(Cell) * nb) != (ssize_t)(sizeof(Cell) * nb))
+              || fsync(fd) < 0;
+    close(fd);
+    if (bad || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Read a snapshot's header; the level it was played at, or 0 to start a
+   new game. The body is read by snapshot_load() once the play area is
+   laid out. */
+int snapshot_open(const char *path) {
+    SnapHeader *h = &snap_hdr;
+    snap_fd = open(path, O_RDONLY);
+    if (snap_fd < 0) return 0;
+    if (read(snap_fd, h, sizeof(*h)) != sizeof(*h) || h->magic != SNAP_MAGIC
+        || h->version != SNAP_VERSION || h->game != SCORE_GAME_SNAKE
+        || h->w != max_x || h->h != max_y || h->level < 1 || h->level > 3) {
+        close(snap_fd);
+        snap_fd = -1;
+        return 0;
+    }
+    return h->level;
+}
+
+/* Start a game and put the snapshot's body, food and score in place;
+   anything amiss leaves the fresh game */
+void snapshot_load() {
+    long long t0 = now_ns();
+    SnapHeader h = snap_hdr;
+    init_game();
+    /* tail first from body[0], so the head lands at body[len - 1] */
+    int ok = h.len >= 2 && h.len <= snake.cap
+             && read(snap_fd, snake.body, sizeof(Cell) * h.len) == (ssize_t)(sizeof(Cell) * h.len);
+    close(snap_fd);
+    snap_fd = -1;
+    uint64_t check = h.check;
+    h.check = 0;
+    ok = ok && fnv(fnv(0xcbf29ce484222325ULL, &h, sizeof(h)), snake.body, sizeof(Cell) * h.len) == check;
+    ok = ok && abs(h.dir_x) + abs(h.dir_y) == 1;
+    for (int k = -1; ok && k < h.len; ++k) {
+        Cell c = k < 0 ? (Cell){ h.food_x, h.food_y } : snake.body[k];
+        ok = c.x > play_x0 && c.x < play_x0 + play_w - 1 && c.y > play_y0 && c.y < play_y0 + play_h - 1;
+    }
+    if (!ok) {
+        free_snake();
+        init_game();
+        return;
+    }
+
+    memset(occupied, 0, play_w * play_h);
+    snake.head = h.len - 1;
+    snake.len = h.len;
+    for (int k = 0; k < h.len; ++k) (*occupied_at(snake.body[k].x, snake.body[k].y))++;
+    snake.dir_x = h.dir_x;
+    snake.dir_y = h.dir_y;
+    food = (Food){ h.food_x, h.food_y };
+    score = h.score;
+    moves = h.moves;
+    game_seed = h.seed;
+    srand(game_seed + moves);
+    zhash = zobrist_full();
+    snap_resumed = 1;
+    snap_load_ns = now_ns() - t0;
+}
+
+/* Fork between moves; the child writes the snapshot and exits */
+void snapshot_start() {
+    if (snap_pid > 0) return;
+    long long t0 = now_ns();
+    pid_t pid = fork();
+    if (pid == 0) _exit(snapshot_write(snap_path) < 0);
+    long long dt = now_ns() - t0;
+    if (pid < 0) {
+        snap_failed++;
+        return;
+    }
+    snap_pid = pid;
+    snap_started_at = t0;
+    snap_forks++;
+    snap_fork_ns += dt;
+    if (dt > snap_fork_max) snap_fork_max = dt;
+    snap_bytes = sizeof(SnapHeader) + sizeof(Cell) * snake.len;
+}
+
+/* Reap the snapshot child if it is done (or wait for it) */
+void snapshot_poll(int block) {
+    int st;
+    if (snap_pid <= 0 || waitpid(snap_pid, &st, block ? 0 : WNOHANG) != snap_pid) return;
+    snap_pid = 0;
+    if (WIFEXITED(st) && WEXITSTATUS(st) == 0) {
+        snap_written++;
+        snap_write_ns += now_ns() - snap_started_at;
+    } else {
+        snap_failed++;
+    }
+}
+
+void init_colors() {
+    start_color();
+    init_pair(1, COLOR_GREEN, COLOR_BLACK);   // Snake
+    init_pair(2, COLOR_RED, COLOR_BLACK);     // Food
+    init_pair(3, COLOR_CYAN, COLOR_BLACK);    // Borders
+    init_pair(4, COLOR_YELLOW, COLOR_BLACK);  // Score / Text
+    init_pair(5, COLOR_MAGENTA, COLOR_BLACK); // Menu highlight
+}
+
+/* ZYGOTE_FDS descriptors in one SCM_RIGHTS message, with a byte of data
+   to carry it */
+int send_fds(int sock, const int *fds) {
+    char byte = 0;
+    char ctl[CMSG_SPACE(sizeof(int) * ZYGOTE_FDS)];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr m = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl, .msg_controllen = sizeof(ctl) };
+    struct cmsghdr *c = CMSG_FIRSTHDR(&m);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * ZYGOTE_FDS);
+    memcpy(CMSG_DATA(c), fds, sizeof(int) * ZYGOTE_FDS);
+    return sendmsg(sock, &m, 0) == 1 ? 0 : -1;
+}
+
+int recv_fds(int sock, int *fds) {
+    char byte;
+    char ctl[CMSG_SPACE(sizeof(int) * ZYGOTE_FDS)];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr m = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl, .msg_controllen = sizeof(ctl) };
+    if (recvmsg(sock, &m, 0) != 1) return -1;
+    struct cmsghdr *c = CMSG_FIRSTHDR(&m);
+    if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) return -1;
+    if (c->cmsg_len != CMSG_LEN(sizeof(int) * ZYGOTE_FDS)) {
+        int n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < n; ++i) close(((int *)CMSG_DATA(c))[i]);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(c), sizeof(int) * ZYGOTE_FDS);
+    return 0;
+}
+
+/* Builds the screen on /dev/null, then serves connections for good.
+   Returns 0 in a session's child, with fds 0-2 on the session's terminal
+   and in a session of its own, or -1 if the zygote could not start. */
+int zygote_main(const char *path) {
+    struct sockaddr_un a = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(a.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return -1;
+    }
+    strcpy(a.sun_path, path);
+    int null = open("/dev/null", O_RDWR);
+    if (null < 0 || dup2(null, STDIN_FILENO) < 0 || dup2(null, STDOUT_FILENO) < 0) {
+        perror("/dev/null");
+        return -1;
+    }
+    close(null);
+    zygote_screen = newterm(NULL, stdout, stdin);
+    if (!zygote_screen) {
+        fprintf(stderr, "zygote: no terminfo entry for TERM\n");
+        return -1;
+    }
+    init_colors();
+
+    int ls = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (ls < 0 || bind(ls, (struct sockaddr *)&a, sizeof(a)) < 0 || listen(ls, ZYGOTE_BACKLOG) < 0) {
+        perror(path);
+        return -1;
+    }
+    signal(SIGCHLD, SIG_IGN);
+    fprintf(stderr, "Zygote: pid %d listening on %s\n", getpid(), path);
+    for (;;) {
+        int c = accept(ls, NULL, NULL);
+        if (c < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            return -1;
+        }
+        long long t0 = now_ns();
+        int fds[ZYGOTE_FDS];
+        if (recv_fds(c, fds) < 0) {
+            close(c);
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            signal(SIGCHLD, SIG_DFL);
+            close(ls);
+            setsid();
+            for (int i = 0; i < ZYGOTE_FDS; ++i) {
+                dup2(fds[i], i);
+                close(fds[i]);
+            }
+            zygote_conn = c;
+            zygote_spawned_at = t0;
+            return 0;
+        }
+        for (int i = 0; i < ZYGOTE_FDS; ++i) close(fds[i]);
+        close(c);
+        if (pid < 0) perror("fork");
+        else fprintf(stderr, "Zygote: session %d forked in %.0f us\n", pid, (now_ns() - t0) / 1e3);
+    }
+}
+
+/* In a session's child, in place of initscr(): the zygote's screen now
+   writes to the session's terminal but took its tty modes and size from
+   /dev/null. Read both from the terminal, then leave and re-enter curses
+   so the terminal gets its init strings and a full repaint. */
+void zygote_attach() {
+    struct winsize ws;
+    def_shell_mode();
+    def_prog_mode();
     endwin();
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row && ws.ws_col)
+        resizeterm(ws.ws_row, ws.ws_col);
+    refresh();
+}
+
+/* -C: hand this terminal to the zygote and wait until the game on it
+   closes the connection. The game is not in the terminal's foreground
+   process group, so ^C and ^\ land here and are ignored. */
+int zygote_client(const char *path) {
+    struct sockaddr_un a = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(a.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return 1;
+    }
+    strcpy(a.sun_path, path);
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    int fds[ZYGOTE_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    if (s < 0 || connect(s, (struct sockaddr *)&a, sizeof(a)) < 0 || send_fds(s, fds) < 0) {
+        perror(path);
+        return 1;
+    }
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    char byte;
+    ssize_t n;
+    while ((n = read(s, &byte, 1)) > 0 || (n < 0 && errno == EINTR));
+    return 0;
+}
+
+/* Time from the zygote taking the request to the first frame on screen */
+void note_first_frame() {
+    if (zygote_spawned_at && !first_frame_ns) first_frame_ns = now_ns() - zygote_spawned_at;
+}
+
+/* Hot path: claim this thread's ring once, then one record store */
+void log_put(int fmt, long a, long b, long c, long d) {
+    if (log_slot < 0) {
+        log_slot = atomic_fetch_add(&log_n_rings, 1);
+        if (log_slot >= LOG_MAX_THREADS) log_slot = LOG_MAX_THREADS;
+    }
+    if (log_slot == LOG_MAX_THREADS) return;
+    LogRing *r = &log_rings[log_slot];
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&r->tail, memory_order_acquire) == LOG_RING_RECS) {
+        r->dropped++;
+        return;
+    }
+    LogRec *rec = &r->recs[head & (LOG_RING_RECS - 1)];
+    rec->t_ns = now_ns();
+    rec->fmt = fmt;
+    rec->args[0] = a;
+    rec->args[1] = b;
+    rec->args[2] = c;
+    rec->args[3] = d;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+int log_start(const char *path) {
+    log_file = fopen(path, "w");
+    if (!log_file) {
+        perror(path);
+        return -1;
+    }
+    atomic_store(&log_running, 1);
+    pthread_create(&log_tid, NULL, log_main, NULL);
+    return 0;
+}
+
+/* Called after endwin(), so the summary lands on the normal screen */
+void log_stop() {
+    if (!log_file) return;
+    atomic_store(&log_running, 0);
+    pthread_join(log_tid, NULL);
+    unsigned long dropped = 0;
+    int n = atomic_load(&log_n_rings);
+    if (n > LOG_MAX_THREADS) n = LOG_MAX_THREADS;
+    for (int i = 0; i < n; ++i) dropped += log_rings[i].dropped;
+    fclose(log_file);
+    log_file = NULL;
+    printf("Log: %lu records from %d threads, %lu dropped\n", log_written, n, dropped);
+}
+
+/* Write out everything published so far, oldest first across rings;
+   returns how many records that was */
+int log_drain() {
+    int n = atomic_load(&log_n_rings), done = 0;
+    if (n > LOG_MAX_THREADS) n = LOG_MAX_THREADS;
+    unsigned end[LOG_MAX_THREADS];
+    for (int i = 0; i < n; ++i)
+        end[i] = atomic_load_explicit(&log_rings[i].head, memory_order_acquire);
+    while (1) {
+        int best = -1;
+        long long t = 0;
+        for (int i = 0; i < n; ++i) {
+            unsigned tail = atomic_load_explicit(&log_rings[i].tail, memory_order_relaxed);
+            if (tail == end[i]) continue;
+            LogRec *rec = &log_rings[i].recs[tail & (LOG_RING_RECS - 1)];
+            if (best < 0 || rec->t_ns < t) {
+                best = i;
+                t = rec->t_ns;
+            }
+        }
+        if (best < 0) return done;
+        LogRing *r = &log_rings[best];
+        unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        LogRec *rec = &r->recs[tail & (LOG_RING_RECS - 1)];
+        fprintf(log_file, "%lld.%09lld [%d] ", rec->t_ns / 1000000000LL, rec->t_ns % 1000000000LL, best);
+        fprintf(log_file, log_fmts[rec->fmt], rec->args[0], rec->args[1], rec->args[2], rec->args[3]);
+        fputc('\n', log_file);
+        atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+        log_written++;
+        done++;
+    }
+}
+
+void *log_main(void *arg) {
+    (void)arg;
+    while (atomic_load(&log_running)) {
+        if (log_drain()) fflush(log_file);
+        usleep(LOG_DRAIN_US);
+    }
+    log_drain();
+    return NULL;
 }
 